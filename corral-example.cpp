@@ -504,6 +504,70 @@ void take_example()
     Verify( ! is_foo_closed, "Did take_example outer corral_config<foo>::on_reset() get called?" );
 }
 
+void stateless_config_size_example()
+{
+    Verify( sizeof( corral_config_store< corral_config< FILE * >, FILE * > ) == sizeof( FILE * ),
+            "Does stateless_config_size_example corral_config< FILE * > take no space?" );
+}
+
+class bad_corral_pooled : public bad_corral {};
+
+class pooled {};
+
+struct handle_pool
+{
+    handle_pool() : n_returned( 0 ) {}
+    int n_returned;
+};
+
+namespace crrl {
+template<>
+struct corral_config< pooled >
+{
+    typedef int value_t;
+    corral_config() : p_pool( 0 ), limit( 0 ) {}
+    corral_config( handle_pool * p_pool_in, int limit_in ) : p_pool( p_pool_in ), limit( limit_in ) {}
+    bool validator( const value_t & h ) const { return p_pool != 0 && h >= 0 && h < limit; }
+    void on_reset( value_t & h ) { ++p_pool->n_returned; }
+    typedef bad_corral_pooled Texception;
+
+    handle_pool * p_pool;
+    int limit;
+};
+}   // namespace crrl
+
+corral<pooled> pooled_op( handle_pool & pool, int h )
+{
+    return corral<pooled>( h, corral_config<pooled>( &pool, 10 ) );
+}
+
+void stateful_config_example()
+{
+    handle_pool pool_a, pool_b;
+    {
+        corral<pooled> unconfigured( 1 );
+        Verify( ! unconfigured.is_valid(), "Is stateful_config_example default config invalid?" );
+
+        corral<pooled> over_limit( 10, corral_config<pooled>( &pool_a, 10 ) );
+        Verify( ! over_limit.is_valid(), "Did stateful_config_example validator use the config's limit?" );
+
+        corral<pooled> a( pooled_op( pool_a, 1 ) );
+        Verify( a.is_valid() && a.config().p_pool == &pool_a,
+                "Did stateful_config_example bridge carry the config?" );
+
+        corral<pooled> b( 2, corral_config<pooled>( &pool_b, 10 ) );
+        b.take( a );
+        Verify( pool_b.n_returned == 1, "Did stateful_config_example take() reset b to pool_b?" );
+        Verify( b.config().p_pool == &pool_a, "Did stateful_config_example take() carry the config?" );
+
+        corral<pooled> moved( b );
+        Verify( moved.config().p_pool == &pool_a, "Did stateful_config_example move carry the config?" );
+        Verify( pool_a.n_returned == 0, "Is stateful_config_example handle still out of pool_a?" );
+    }
+    Verify( pool_a.n_returned == 1, "Did stateful_config_example return the handle to pool_a?" );
+    Verify( pool_b.n_returned == 1, "Did stateful_config_example return only 1 handle to pool_b?" );
+}
+
 int main( int argc, char * argv[] )
 {
     simple_no_value_set_example();
@@ -521,6 +585,8 @@ int main( int argc, char * argv[] )
     double_indirect_type_example();
     double_indirect_type_bad_value_example();
     take_example();
+    stateless_config_size_example();
+    stateful_config_example();
 
     report();
 
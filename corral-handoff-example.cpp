@@ -0,0 +1,323 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "corral-handoff.h"
+
+#include "annotate-lite.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <vector>
+
+using namespace crrl;
+
+class bad_corral_fd : public bad_corral {};
+
+class posix_fd {};
+
+int n_fds_reset = 0;
+
+namespace crrl {
+template<>
+struct corral_config< posix_fd >
+{
+    typedef int value_t;
+    static bool validator( const value_t & fd ) { return fd >= 0 && fcntl( fd, F_GETFD ) != -1; }
+    static void on_reset( value_t & fd )
+    {
+        ++n_fds_reset;
+        close( fd );
+    }
+    typedef bad_corral_fd Texception;
+};
+}   // namespace crrl
+
+class checked_fd {};
+
+namespace crrl {
+template<>
+struct corral_config< checked_fd >
+{
+    corral_config() : m_is_throwing( false ) {}
+
+    typedef int value_t;
+    bool validator( const value_t & fd ) const
+    {
+        if( m_is_throwing )
+            throw bad_corral_fd();
+        return fd >= 0;
+    }
+    static void on_reset( value_t & fd ) { close( fd ); }
+    typedef bad_corral_fd Texception;
+
+    bool m_is_throwing;
+};
+}   // namespace crrl
+
+bool is_open( int fd )
+{
+    return fcntl( fd, F_GETFD ) != -1;
+}
+
+std::string numbered_tag( int i )
+{
+    std::ostringstream tag;
+    tag << "pipe-" << i;
+    return tag.str();
+}
+
+void handoff_example()
+{
+    int sockets[2];
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sockets ) != 0 )
+    {
+        Bad( "handoff_example couldn't create socketpair" );
+        return;
+    }
+    corral<posix_fd> old_socket( sockets[0] ), new_socket( sockets[1] );
+
+    n_fds_reset = 0;
+    std::vector< int > write_ends;
+    corral_handoff_receiver receiver;
+    try
+    {
+        corral_handoff_sender sender;
+
+        corral<posix_fd> in( open( "test-exists.txt", O_RDONLY ) );
+        int in_fd = in.get();
+        sender.add( "test-exists", in );
+        Verify( ! in.is_valid(), "Did handoff_example sender take the corral?" );
+
+        // More than fit in one message
+        for( int i = 0; i < 150; ++i )
+        {
+            int pipe_fds[2];
+            if( pipe( pipe_fds ) != 0 )
+                break;
+            write_ends.push_back( pipe_fds[1] );
+            corral<posix_fd> read_end( pipe_fds[0] );
+            sender.add( numbered_tag( i ), read_end );
+        }
+        Verify( sender.size() == 151, "Did handoff_example add all corrals?" );
+
+        sender.send( old_socket.get() );
+        Verify( sender.size() == 0, "Did handoff_example send all corrals?" );
+        Verify( ! is_open( in_fd ), "Did handoff_example sender close its copy?" );
+
+        receiver.receive( new_socket.get() );
+        Verify( receiver.size() == 151, "Did handoff_example receive all corrals?" );
+    }
+    catch( bad_corral_handoff & )
+    {
+        Bad( "handoff_example threw bad_corral_handoff" );
+    }
+    catch( ... )
+    {
+        Bad( "Unknown handoff_example exception thrown" );
+    }
+    Verify( n_fds_reset == 0, "Did handoff_example avoid calling on_reset for handed off corrals?" );
+
+    corral<posix_fd> in;
+    Verify( receiver.claim( "test-exists", in ), "Did handoff_example claim test-exists?" );
+    char c = 0;
+    Verify( in.is_valid() && read( in.get(), &c, 1 ) == 0, "Can handoff_example read the (empty) claimed file?" );
+    Verify( ! receiver.claim( "test-exists", in ), "Did handoff_example only claim test-exists once?" );
+    Verify( ! in.is_valid(), "Is handoff_example failed claim invalid?" );
+
+    int read_fd = -1;
+    {
+        corral<posix_fd> read_end;
+        Verify( receiver.claim( numbered_tag( 7 ), read_end ), "Did handoff_example claim pipe-7?" );
+        read_fd = read_end.get();
+        Verify( write( write_ends[7], "x", 1 ) == 1 && read( read_fd, &c, 1 ) == 1 && c == 'x',
+                "Is handoff_example pipe-7 connected?" );
+    }
+    Verify( ! is_open( read_fd ), "Did handoff_example claimed corral close pipe-7?" );
+    Verify( receiver.size() == 149, "Are handoff_example unclaimed fds still held?" );
+
+    for( size_t i = 0; i < write_ends.size(); ++i )
+        close( write_ends[i] );
+}
+
+void handoff_unclaimed_example()
+{
+    int sockets[2];
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sockets ) != 0 )
+    {
+        Bad( "handoff_unclaimed_example couldn't create socketpair" );
+        return;
+    }
+    corral<posix_fd> old_socket( sockets[0] ), new_socket( sockets[1] );
+
+    int received_fd = -1;
+    {
+        corral_handoff_receiver receiver;
+        corral_handoff_sender sender;
+        corral<posix_fd> in( open( "test-exists.txt", O_RDONLY ) );
+        sender.add( "test-exists", in );
+        sender.send( old_socket.get() );
+        receiver.receive( new_socket.get() );
+
+        // Claim and hand back again, so that the receiver holds an unclaimed fd
+        corral<posix_fd> claimed;
+        receiver.claim( "test-exists", claimed );
+        received_fd = claimed.release();
+        corral<posix_fd> again( received_fd );
+        sender.add( "again", again );
+        sender.send( old_socket.get() );
+        receiver.receive( new_socket.get() );
+        Verify( receiver.count( "again" ) == 1, "Did handoff_unclaimed_example receive 'again'?" );
+    }
+    // Kernel reuses the lowest free fd, so the unclaimed one should be closed
+    int probe = open( "test-exists.txt", O_RDONLY );
+    Verify( probe <= received_fd, "Did handoff_unclaimed_example receiver close unclaimed fds?" );
+    close( probe );
+}
+
+void handoff_failed_send_example()
+{
+    int sockets[2];
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sockets ) != 0 )
+    {
+        Bad( "handoff_failed_send_example couldn't create socketpair" );
+        return;
+    }
+    corral<posix_fd> old_socket( sockets[0] );
+    close( sockets[1] );    // No successor to receive anything
+
+    n_fds_reset = 0;
+    int in_fd = -1;
+    try
+    {
+        corral_handoff_sender sender;
+        corral<posix_fd> in( open( "test-exists.txt", O_RDONLY ) );
+        in_fd = in.get();
+        sender.add( "test-exists", in );
+        try
+        {
+            sender.send( old_socket.get() );
+            Bad( "handoff_failed_send_example didn't throw" );
+        }
+        catch( bad_corral_handoff & )
+        {
+            Good( "handoff_failed_send_example threw bad_corral_handoff" );
+        }
+        Verify( sender.size() == 1, "Does handoff_failed_send_example sender still own the corral?" );
+        Verify( is_open( in_fd ), "Is handoff_failed_send_example fd still open?" );
+    }
+    catch( ... )
+    {
+        Bad( "Unknown handoff_failed_send_example exception thrown" );
+    }
+    Verify( n_fds_reset == 1, "Did handoff_failed_send_example sender call on_reset?" );
+    Verify( ! is_open( in_fd ), "Did handoff_failed_send_example sender close the fd?" );
+}
+
+void handoff_early_close_example()
+{
+    int sockets[2];
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sockets ) != 0 )
+    {
+        Bad( "handoff_early_close_example couldn't create socketpair" );
+        return;
+    }
+    corral<posix_fd> new_socket( sockets[1] );
+    close( sockets[0] );    // Predecessor went away without sending the end marker
+
+    corral_handoff_receiver receiver;
+    try
+    {
+        receiver.receive( new_socket.get() );
+        Bad( "handoff_early_close_example didn't throw" );
+    }
+    catch( bad_corral_handoff & )
+    {
+        Good( "handoff_early_close_example threw bad_corral_handoff" );
+    }
+    catch( ... )
+    {
+        Bad( "Unknown handoff_early_close_example exception thrown" );
+    }
+}
+
+void handoff_throwing_validator_example()
+{
+    int sockets[2];
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sockets ) != 0 )
+    {
+        Bad( "handoff_throwing_validator_example couldn't create socketpair" );
+        return;
+    }
+    corral<posix_fd> old_socket( sockets[0] ), new_socket( sockets[1] );
+
+    corral_handoff_receiver receiver;
+    corral_handoff_sender sender;
+    corral<posix_fd> in( open( "test-exists.txt", O_RDONLY ) );
+    sender.add( "test-exists", in );
+    sender.send( old_socket.get() );
+    receiver.receive( new_socket.get() );
+
+    corral<checked_fd> claimed;
+    claimed.config().m_is_throwing = true;
+    try
+    {
+        receiver.claim( "test-exists", claimed );
+        Bad( "handoff_throwing_validator_example didn't throw" );
+    }
+    catch( bad_corral_fd & )
+    {
+        Good( "handoff_throwing_validator_example threw bad_corral_fd" );
+    }
+    Verify( receiver.count( "test-exists" ) == 1,
+            "Does handoff_throwing_validator_example receiver still own the fd?" );
+
+    claimed.config().m_is_throwing = false;
+    Verify( receiver.claim( "test-exists", claimed ) && claimed.is_valid(),
+            "Did handoff_throwing_validator_example claim the fd afterwards?" );
+}
+
+int main( int argc, char * argv[] )
+{
+    handoff_example();
+    handoff_unclaimed_example();
+    handoff_failed_send_example();
+    handoff_early_close_example();
+    handoff_throwing_validator_example();
+
+    report();
+
+    return 0;
+}
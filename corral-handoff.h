@@ -0,0 +1,408 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// corral_handoff - Pass file descriptors owned by corrals to a successor
+// process over a local Unix domain socket, so that a restarted process does
+// not have to reopen every file and socket.
+//
+// The old process adds its fd-backed corrals to a corral_handoff_sender,
+// each with a tag describing what it is, and calls send().  The new process
+// calls corral_handoff_receiver::receive() and then claim()s each tag into a
+// corral, which re-runs the corral's validator.
+//
+// Tags are chosen by the caller and are the only thing sent with each
+// descriptor.  Nothing records the sending corral's config type, so it is up
+// to the caller to claim each tag into a corral of a matching type (e.g. by
+// putting the type in the tag).  The validator is the only other check.
+//
+// Ownership rules:
+//
+// - Once a corral has been added to a corral_handoff_sender, the sender owns
+//   the resource.  When the batch containing it has been sent the sender
+//   closes its copy of the descriptor with close() rather than on_reset(),
+//   because on_reset() may do things (e.g. shutdown() a socket) that would
+//   affect the successor's copy.  Resources that could not be sent are
+//   cleaned up with on_reset() in the sender's destructor, as the corral
+//   would have done.
+//
+// - The receiver owns every descriptor it has received until it is claimed.
+//   Descriptors that are never claimed, or that fail validation on claim(),
+//   are closed.  If receive() throws part way through a handoff, descriptors
+//   from the batches that did arrive are still available to claim().
+//
+// The socket must preserve message boundaries, i.e. be created with
+// SOCK_SEQPACKET (or SOCK_DGRAM).  The corral_config value_t must be an int
+// file descriptor.
+//
+// Unlike corral.h, this file requires C++11 and POSIX.
+
+#ifndef CORRAL_HANDOFF_H
+#define CORRAL_HANDOFF_H
+
+#include "corral.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace crrl {
+
+class bad_corral_handoff : public bad_corral
+{
+    virtual const char * what() const throw()
+    {
+        return "bad_corral_handoff exception";
+    }
+};
+
+namespace handoff_detail {
+
+// Each message is: magic, count, then count * (tag length, tag bytes).  The
+// descriptors travel as SCM_RIGHTS ancillary data in the same order.  A
+// message with a count of 0 marks the end of the handoff.
+static const char magic[4] = { 'c', 'r', 'l', 'h' };
+static const size_t max_fds_per_message = 64;
+static const size_t max_tag_size = 1024;
+static const size_t max_message_size = sizeof( magic ) + sizeof( unsigned int ) +
+                                max_fds_per_message * ( sizeof( unsigned int ) + max_tag_size );
+
+inline void append( std::vector< char > & message, const void * p_data, size_t size )
+{
+    message.insert( message.end(), static_cast< const char * >( p_data ),
+                    static_cast< const char * >( p_data ) + size );
+}
+
+inline void append( std::vector< char > & message, unsigned int n )
+{
+    append( message, &n, sizeof( n ) );
+}
+
+inline bool extract( const char * & p_data, const char * p_end, void * p_to, size_t size )
+{
+    if( static_cast< size_t >( p_end - p_data ) < size )
+        return false;
+    memcpy( p_to, p_data, size );
+    p_data += size;
+    return true;
+}
+
+}   // namespace handoff_detail
+
+class corral_handoff_sender
+{
+private:
+    struct entry
+    {
+        explicit entry( const std::string & tag ) : m_tag( tag ) {}
+        virtual ~entry() {}
+        virtual int fd() const = 0;
+        virtual void close_sent() = 0;
+
+        std::string m_tag;
+    };
+
+    template< typename Tcorral >
+    struct corral_entry : public entry
+    {
+        explicit corral_entry( const std::string & tag ) : entry( tag ) {}
+        virtual int fd() const { return m_corral.get(); }
+        virtual void close_sent()
+        {
+#if defined( CORRAL_TRACE )
+            corral_trace_id trace_id = m_corral.trace_id();
+            ::close( m_corral.release() );
+            corral_tracer::closed( trace_id );  // Not a leak, see corral-trace.h
+#else
+            ::close( m_corral.release() );
+#endif
+        }
+
+        Tcorral m_corral;   // Calls on_reset() if never sent
+    };
+
+    std::vector< entry * > m_entries;   // Not yet sent
+
+public:
+    corral_handoff_sender() {}
+    ~corral_handoff_sender()
+    {
+        for( size_t i = 0; i < m_entries.size(); ++i )
+            delete m_entries[i];
+    }
+
+    size_t size() const { return m_entries.size(); }
+
+    // Take ownership of c's resource, to be sent with the given tag.  Invalid
+    // corrals are ignored.
+    template< typename TvalueId, typename Texception, typename Tconfig >
+    void add( const std::string & tag, corral< TvalueId, Texception, Tconfig > & c )
+    {
+        static_assert( std::is_convertible< typename corral< TvalueId, Texception, Tconfig >::value_t, int >::value,
+                        "corral_handoff requires corrals of file descriptors" );
+        if( tag.size() > handoff_detail::max_tag_size )
+            throw bad_corral_handoff();
+        if( ! c.is_valid() )
+            return;
+        std::unique_ptr< corral_entry< corral< TvalueId, Texception, Tconfig > > >
+                p_entry( new corral_entry< corral< TvalueId, Texception, Tconfig > >( tag ) );
+        m_entries.push_back( 0 );
+        p_entry->m_corral.take( c );
+        m_entries.back() = p_entry.release();
+    }
+
+    // Send everything added so far.  Throws bad_corral_handoff if the socket
+    // fails, in which case the entries not yet sent are still owned by this
+    // object and send() can be retried on another socket.
+    void send( int socket )
+    {
+        while( ! m_entries.empty() )
+        {
+            size_t n_batch = m_entries.size() < handoff_detail::max_fds_per_message ?
+                                m_entries.size() : handoff_detail::max_fds_per_message;
+            std::vector< char > message;
+            std::vector< int > fds;
+            handoff_detail::append( message, handoff_detail::magic, sizeof( handoff_detail::magic ) );
+            handoff_detail::append( message, static_cast< unsigned int >( n_batch ) );
+            for( size_t i = 0; i < n_batch; ++i )
+            {
+                const std::string & tag = m_entries[i]->m_tag;
+                handoff_detail::append( message, static_cast< unsigned int >( tag.size() ) );
+                handoff_detail::append( message, tag.data(), tag.size() );
+                fds.push_back( m_entries[i]->fd() );
+            }
+            send_message( socket, message, fds );
+
+            for( size_t i = 0; i < n_batch; ++i )
+            {
+                m_entries[i]->close_sent();
+                delete m_entries[i];
+            }
+            m_entries.erase( m_entries.begin(), m_entries.begin() + n_batch );
+        }
+
+        std::vector< char > end;
+        handoff_detail::append( end, handoff_detail::magic, sizeof( handoff_detail::magic ) );
+        handoff_detail::append( end, 0u );
+        send_message( socket, end, std::vector< int >() );
+    }
+
+private:
+    static void send_message( int socket, std::vector< char > & message, const std::vector< int > & fds )
+    {
+        struct iovec iov;
+        iov.iov_base = &message[0];
+        iov.iov_len = message.size();
+
+        std::vector< char > control( fds.empty() ? 0 : CMSG_SPACE( fds.size() * sizeof( int ) ) );
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if( ! fds.empty() )
+        {
+            msg.msg_control = &control[0];
+            msg.msg_controllen = control.size();
+            struct cmsghdr * p_cmsg = CMSG_FIRSTHDR( &msg );
+            p_cmsg->cmsg_level = SOL_SOCKET;
+            p_cmsg->cmsg_type = SCM_RIGHTS;
+            p_cmsg->cmsg_len = CMSG_LEN( fds.size() * sizeof( int ) );
+            memcpy( CMSG_DATA( p_cmsg ), &fds[0], fds.size() * sizeof( int ) );
+        }
+
+        int flags = 0;
+#if defined( MSG_NOSIGNAL )
+        flags |= MSG_NOSIGNAL;
+#endif
+        ssize_t n_sent;
+        do
+            n_sent = ::sendmsg( socket, &msg, flags );
+        while( n_sent < 0 && errno == EINTR );
+        if( n_sent != static_cast< ssize_t >( message.size() ) )
+            throw bad_corral_handoff();
+    }
+
+    corral_handoff_sender( const corral_handoff_sender & );     // Disable copying
+    corral_handoff_sender & operator = ( const corral_handoff_sender & );
+};
+
+class corral_handoff_receiver
+{
+private:
+    typedef std::multimap< std::string, int > fds_t;
+    fds_t m_fds;    // Received but not yet claimed
+
+public:
+    corral_handoff_receiver() {}
+    ~corral_handoff_receiver()
+    {
+        for( fds_t::iterator i = m_fds.begin(); i != m_fds.end(); ++i )
+            ::close( i->second );
+    }
+
+    size_t size() const { return m_fds.size(); }
+    size_t count( const std::string & tag ) const { return m_fds.count( tag ); }
+
+    // Receive descriptors until the sender's end marker arrives.  Throws
+    // bad_corral_handoff if the socket fails, is closed early or receives a
+    // malformed message.
+    void receive( int socket )
+    {
+        while( receive_message( socket ) )
+        {}
+    }
+
+    // Move a received descriptor with the given tag into 'into', running the
+    // validator of into's config.  Returns false, leaving 'into' reset, if
+    // there is no such descriptor or it fails validation (in which case it is
+    // closed).  If the validator throws, the descriptor stays unclaimed.
+    // Only the tag is checked, so the caller must claim each tag into a
+    // corral of the type it was sent from.
+    template< typename TvalueId, typename Texception, typename Tconfig >
+    bool claim( const std::string & tag, corral< TvalueId, Texception, Tconfig > & into )
+    {
+        into.reset();
+        fds_t::iterator i = m_fds.find( tag );
+        if( i == m_fds.end() )
+            return false;
+        int fd = i->second;
+        // If the validator throws, the receiver still owns the descriptor
+        corral< TvalueId, Texception, Tconfig > claimed( fd, into.config() );
+        m_fds.erase( i );
+        if( ! claimed.is_valid() )
+        {
+            ::close( fd );
+            return false;
+        }
+        into.take( claimed );
+        return true;
+    }
+
+private:
+    bool /* is_more */ receive_message( int socket )
+    {
+        std::vector< char > message( handoff_detail::max_message_size );
+        struct iovec iov;
+        iov.iov_base = &message[0];
+        iov.iov_len = message.size();
+
+        std::vector< char > control( CMSG_SPACE( handoff_detail::max_fds_per_message * sizeof( int ) ) );
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        std::vector< int > fds;     // Reserved so that taking ownership can't throw
+        fds.reserve( handoff_detail::max_fds_per_message );
+
+        int flags = 0;
+#if defined( MSG_CMSG_CLOEXEC )
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+        ssize_t n_received;
+        do
+            n_received = ::recvmsg( socket, &msg, flags );
+        while( n_received < 0 && errno == EINTR );
+
+        // Take ownership of whatever arrived before checking anything else
+        if( n_received >= 0 )
+            for( struct cmsghdr * p_cmsg = CMSG_FIRSTHDR( &msg ); p_cmsg; p_cmsg = CMSG_NXTHDR( &msg, p_cmsg ) )
+                if( p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS )
+                {
+                    size_t n_fds = ( p_cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+                    const char * p_fd = reinterpret_cast< const char * >( CMSG_DATA( p_cmsg ) );
+                    for( size_t i = 0; i < n_fds; ++i )
+                    {
+                        int fd;
+                        memcpy( &fd, p_fd + i * sizeof( int ), sizeof( int ) );
+                        fds.push_back( fd );
+                    }
+                }
+
+        size_t n_kept = 0;
+        unsigned int n_entries = 0;
+        try
+        {
+            if( n_received <= 0 || ( msg.msg_flags & ( MSG_TRUNC | MSG_CTRUNC ) ) != 0 )
+                throw bad_corral_handoff();
+
+            const char * p_data = &message[0];
+            const char * p_end = p_data + n_received;
+            char magic[sizeof( handoff_detail::magic )];
+            if( ! handoff_detail::extract( p_data, p_end, magic, sizeof( magic ) ) ||
+                    memcmp( magic, handoff_detail::magic, sizeof( magic ) ) != 0 ||
+                    ! handoff_detail::extract( p_data, p_end, &n_entries, sizeof( n_entries ) ) ||
+                    n_entries != fds.size() )
+                throw bad_corral_handoff();
+
+            std::vector< std::string > tags;
+            for( size_t i = 0; i < n_entries; ++i )
+            {
+                unsigned int tag_size;
+                if( ! handoff_detail::extract( p_data, p_end, &tag_size, sizeof( tag_size ) ) ||
+                        tag_size > static_cast< size_t >( p_end - p_data ) )
+                    throw bad_corral_handoff();
+                tags.push_back( std::string( p_data, tag_size ) );
+                p_data += tag_size;
+            }
+
+            for( ; n_kept < n_entries; ++n_kept )
+                m_fds.insert( fds_t::value_type( tags[n_kept], fds[n_kept] ) );
+        }
+        catch( ... )
+        {
+            for( size_t i = n_kept; i < fds.size(); ++i )
+                ::close( fds[i] );
+            throw;
+        }
+
+        return n_entries != 0;
+    }
+
+    corral_handoff_receiver( const corral_handoff_receiver & );     // Disable copying
+    corral_handoff_receiver & operator = ( const corral_handoff_receiver & );
+};
+
+} // namespace crrl
+
+#endif  // CORRAL_HANDOFF_H
@@ -0,0 +1,218 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "corral-single-flight.h"
+
+#include "annotate-lite.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace crrl;
+
+class bad_corral_index : public bad_corral {};
+
+class index_handle {};
+
+std::atomic< int > next_handle( 1 );
+std::atomic< int > n_opened( 0 );
+std::atomic< int > n_duplicated( 0 );
+std::atomic< int > n_reset( 0 );
+
+namespace crrl {
+template<>
+struct corral_config< index_handle >
+{
+    typedef int value_t;
+    static bool validator( const value_t & h ) { return h > 0; }
+    static void on_reset( value_t & h ) { ++n_reset; }
+    typedef bad_corral_index Texception;
+};
+}   // namespace crrl
+
+class index_open_failed {};
+
+corral<index_handle> open_index( const std::string & name )
+{
+    std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );   // A slow, cold open
+    if( name == "throws" )
+        throw index_open_failed();
+    if( name == "missing" )
+        return corral<index_handle>( -1 );
+    ++n_opened;
+    return corral<index_handle>( next_handle++ );
+}
+
+int duplicate_index( const int & h )
+{
+    ++n_duplicated;
+    return next_handle++;
+}
+
+typedef corral_single_flight< index_handle, std::string > index_flights_t;
+
+const int n_callers = 32;
+
+void single_flight_shared_example()
+{
+    n_opened = n_reset = 0;
+    index_flights_t flights;
+    std::vector< std::shared_ptr< corral<index_handle> > > results( n_callers );
+    {
+        std::vector< std::thread > callers;
+        for( int i = 0; i < n_callers; ++i )
+            callers.push_back( std::thread( [&, i]{
+                    results[i] = flights.acquire_shared( "big-index", [] { return open_index( "big-index" ); } );
+                } ) );
+        for( size_t i = 0; i < callers.size(); ++i )
+            callers[i].join();
+    }
+
+    Verify( n_opened == 1, "Did single_flight_shared_example open the index once?" );
+    bool is_all_same = true;
+    for( int i = 0; i < n_callers; ++i )
+        if( results[i] != results[0] || ! results[i]->is_valid() )
+            is_all_same = false;
+    Verify( is_all_same, "Did single_flight_shared_example callers share one valid corral?" );
+
+    corral_single_flight_stats stats = flights.stats();
+    Verify( stats.n_acquired == 1, "Did single_flight_shared_example count 1 acquisition?" );
+    Verify( stats.n_coalesced == n_callers - 1, "Did single_flight_shared_example count the coalesced callers?" );
+    Verify( stats.n_waited <= stats.n_coalesced, "Are single_flight_shared_example waits no more than coalesced?" );
+
+    results.clear();
+    Verify( n_reset == 1, "Did single_flight_shared_example reset the shared corral once?" );
+
+    // Not overlapping, so opened again
+    std::shared_ptr< corral<index_handle> > p_later = flights.acquire_shared( "big-index",
+                                                        [] { return open_index( "big-index" ); } );
+    Verify( n_opened == 2 && flights.stats().n_acquired == 2, "Did single_flight_shared_example reopen later?" );
+}
+
+void single_flight_duplicate_example()
+{
+    n_opened = n_duplicated = n_reset = 0;
+    {
+        index_flights_t flights( duplicate_index );
+        std::vector< int > handles( n_callers );
+        std::vector< std::thread > callers;
+        for( int i = 0; i < n_callers; ++i )
+            callers.push_back( std::thread( [&, i]{
+                    corral<index_handle> index;
+                    flights.acquire( "big-index", [] { return open_index( "big-index" ); }, index );
+                    handles[i] = index.get();
+                } ) );
+        for( size_t i = 0; i < callers.size(); ++i )
+            callers[i].join();
+
+        Verify( n_opened == 1, "Did single_flight_duplicate_example open the index once?" );
+        Verify( n_duplicated == n_callers, "Did single_flight_duplicate_example duplicate for each caller?" );
+        bool is_all_different = true;
+        for( int i = 0; i < n_callers; ++i )
+            for( int j = 0; j < i; ++j )
+                if( handles[i] == handles[j] )
+                    is_all_different = false;
+        Verify( is_all_different, "Did single_flight_duplicate_example callers get their own handles?" );
+        Verify( n_reset == n_callers + 1, "Did single_flight_duplicate_example reset every handle?" );
+
+        n_opened = n_duplicated = n_reset = 0;
+        corral<index_handle> alone;
+        flights.acquire( "big-index", [] { return open_index( "big-index" ); }, alone );
+        Verify( alone.is_valid() && n_opened == 1 && n_duplicated == 0,
+                "Did single_flight_duplicate_example uncontended caller keep the original?" );
+    }
+    Verify( n_reset == 1, "Did single_flight_duplicate_example uncontended caller reset the original?" );
+}
+
+void single_flight_no_duplicator_example()
+{
+    try
+    {
+        index_flights_t flights;
+        corral<index_handle> index;
+        flights.acquire( "big-index", [] { return open_index( "big-index" ); }, index );
+        Bad( "single_flight_no_duplicator_example didn't throw" );
+    }
+    catch( bad_corral_single_flight & )
+    {
+        Good( "single_flight_no_duplicator_example threw bad_corral_single_flight" );
+    }
+    catch( ... )
+    {
+        Bad( "Unknown single_flight_no_duplicator_example exception thrown" );
+    }
+}
+
+void single_flight_failure_example()
+{
+    index_flights_t flights( duplicate_index );
+    std::atomic< int > n_threw( 0 ), n_invalid( 0 );
+    std::vector< std::thread > callers;
+    for( int i = 0; i < n_callers; ++i )
+        callers.push_back( std::thread( [&]{
+                try
+                {
+                    flights.acquire_shared( "throws", [] { return open_index( "throws" ); } );
+                }
+                catch( index_open_failed & )
+                {
+                    ++n_threw;
+                }
+                corral<index_handle> index;
+                flights.acquire( "missing", [] { return open_index( "missing" ); }, index );
+                if( ! index.is_valid() )
+                    ++n_invalid;
+            } ) );
+    for( size_t i = 0; i < callers.size(); ++i )
+        callers[i].join();
+
+    Verify( n_threw == n_callers, "Did single_flight_failure_example callers all get the exception?" );
+    Verify( n_invalid == n_callers, "Did single_flight_failure_example callers all get an invalid corral?" );
+    Verify( flights.stats().n_acquired < 2 * n_callers, "Did single_flight_failure_example coalesce failures?" );
+}
+
+int main( int argc, char * argv[] )
+{
+    single_flight_shared_example();
+    single_flight_duplicate_example();
+    single_flight_no_duplicator_example();
+    single_flight_failure_example();
+
+    report();
+
+    return 0;
+}
@@ -0,0 +1,271 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// corral_single_flight - Coalesce concurrent acquisitions of the same
+// resource.
+//
+// When several threads ask for the same cold resource at once, only the
+// first (the leader) calls the factory function.  The others (the joiners)
+// wait for the leader's result and then either share the leader's corral, or
+// are given their own corral holding a duplicate of the handle (e.g. made
+// with dup()).  If the factory throws, all the callers get the same
+// exception.  If the factory returns an invalid corral, they all get an
+// invalid corral.
+//
+// Only acquisitions that overlap in time are coalesced.  Once the leader has
+// finished, the next acquire() for the same key calls the factory again.
+//
+// Keys are spread over a number of independently locked shards so that
+// unrelated keys rarely contend.  Every call takes its key's shard lock, and
+// the leader takes it twice: once to start the flight and once to end it.
+// There is no lock-free path, because a finished flight is removed rather
+// than kept for later callers.  A joiner whose leader has finished by the
+// time it looks at the result reads it without taking the flight's own
+// lock; otherwise it waits on that lock.
+//
+// Unlike corral.h, this file requires C++11.
+
+#ifndef CORRAL_SINGLE_FLIGHT_H
+#define CORRAL_SINGLE_FLIGHT_H
+
+#include "corral.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace crrl {
+
+class bad_corral_single_flight : public bad_corral
+{
+    virtual const char * what() const throw()
+    {
+        return "bad_corral_single_flight exception";
+    }
+};
+
+struct corral_single_flight_stats
+{
+    unsigned long n_acquired;   // Calls to the factory
+    unsigned long n_coalesced;  // Callers that joined another caller's acquisition
+    unsigned long n_waited;     // Joiners that had to block waiting for the result
+};
+
+template< typename TvalueId,
+            typename Tkey,
+            typename Texception = typename corral_config<TvalueId>::Texception,
+            typename Tconfig = corral_config< TvalueId >,
+            typename Thash = std::hash< Tkey > >
+class corral_single_flight
+{
+public:
+    typedef corral< TvalueId, Texception, Tconfig > corral_t;
+    typedef typename corral_t::value_t value_t;
+    typedef value_t (*duplicator_t)( const value_t & );
+
+private:
+    struct flight
+    {
+        flight() : m_is_resolved( false ), m_n_joined( 0 ) {}
+
+        std::atomic< bool > m_is_resolved;
+        std::shared_ptr< corral_t > m_p_result;
+        std::exception_ptr m_error;
+        size_t m_n_joined;  // Guarded by the shard's mutex
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+    };
+
+    typedef std::unordered_map< Tkey, std::shared_ptr< flight >, Thash > flights_t;
+
+    struct alignas( 64 ) shard     // Keep each shard's lock on its own cache line
+    {
+        std::mutex m_mutex;
+        flights_t m_flights;
+    };
+
+    static const size_t n_shards = 16;
+
+    duplicator_t m_duplicator;
+    Thash m_hash;
+    shard m_shards[n_shards];
+    std::atomic< unsigned long > m_n_acquired;
+    std::atomic< unsigned long > m_n_coalesced;
+    std::atomic< unsigned long > m_n_waited;
+
+public:
+    // The duplicator is only needed by the acquire() that fills a caller's
+    // own corral.  It should return a new handle that validator() accepts.
+    explicit corral_single_flight( duplicator_t duplicator = 0 )
+        : m_duplicator( duplicator ), m_n_acquired( 0 ), m_n_coalesced( 0 ), m_n_waited( 0 )
+    {}
+
+    // Return a corral shared by all the callers that overlapped with this
+    // one.  The resource is reset when the last of them drops its pointer.
+    // factory() must return something that a corral_t can be constructed
+    // from, e.g. a corral< TvalueId > returned from open_file().
+    template< typename Tfactory >
+    std::shared_ptr< corral_t > acquire_shared( const Tkey & key, Tfactory factory )
+    {
+        size_t n_joined;
+        return acquire_flight( key, factory, n_joined );
+    }
+
+    // Put a corral owned only by the caller in 'into'.  The leader keeps the
+    // handle the factory made if no other callers joined it, otherwise each
+    // caller is given a duplicate.  If duplication fails 'into' is invalid.
+    // Throws bad_corral_single_flight if there is no duplicator.
+    template< typename Tfactory >
+    void acquire( const Tkey & key, Tfactory factory, corral_t & into )
+    {
+        if( ! m_duplicator )
+            throw bad_corral_single_flight();
+
+        size_t n_joined = 0;
+        std::shared_ptr< corral_t > p_result = acquire_flight( key, factory, n_joined );
+        if( n_joined == 0 )
+            into.take( *p_result );
+        else if( ! p_result->is_valid() )
+            into.reset();
+        else
+        {
+            corral_t duplicate( m_duplicator( p_result->get() ), p_result->config() );
+            into.take( duplicate );
+        }
+    }
+
+    corral_single_flight_stats stats() const
+    {
+        corral_single_flight_stats stats;
+        stats.n_acquired = m_n_acquired.load( std::memory_order_relaxed );
+        stats.n_coalesced = m_n_coalesced.load( std::memory_order_relaxed );
+        stats.n_waited = m_n_waited.load( std::memory_order_relaxed );
+        return stats;
+    }
+
+private:
+    // n_joined is set for the leader only.  Joiners get a non-zero value.
+    template< typename Tfactory >
+    std::shared_ptr< corral_t > acquire_flight( const Tkey & key, Tfactory & factory, size_t & n_joined )
+    {
+        shard & my_shard = m_shards[m_hash( key ) % n_shards];
+        std::shared_ptr< flight > p_flight;
+        bool is_leader = false;
+        {
+            std::lock_guard< std::mutex > lock( my_shard.m_mutex );
+            std::shared_ptr< flight > & p_existing = my_shard.m_flights[key];
+            if( ! p_existing )
+            {
+                p_existing = std::make_shared< flight >();
+                is_leader = true;
+            }
+            else
+                ++p_existing->m_n_joined;
+            p_flight = p_existing;
+        }
+
+        if( is_leader )
+            return lead( key, my_shard, *p_flight, factory, n_joined );
+
+        n_joined = 1;
+        m_n_coalesced.fetch_add( 1, std::memory_order_relaxed );
+        if( ! p_flight->m_is_resolved.load( std::memory_order_acquire ) )
+        {
+            std::unique_lock< std::mutex > lock( p_flight->m_mutex );
+            if( ! p_flight->m_is_resolved.load( std::memory_order_acquire ) )
+            {
+                m_n_waited.fetch_add( 1, std::memory_order_relaxed );
+                p_flight->m_cv.wait( lock,
+                        [&]{ return p_flight->m_is_resolved.load( std::memory_order_acquire ); } );
+            }
+        }
+        if( p_flight->m_error )
+            std::rethrow_exception( p_flight->m_error );
+        return p_flight->m_p_result;
+    }
+
+    template< typename Tfactory >
+    std::shared_ptr< corral_t > lead( const Tkey & key, shard & my_shard, flight & my_flight,
+                                        Tfactory & factory, size_t & n_joined )
+    {
+        m_n_acquired.fetch_add( 1, std::memory_order_relaxed );
+        try
+        {
+            std::shared_ptr< corral_t > p_result( new corral_t );
+            corral_t acquired( factory() );
+            p_result->take( acquired );
+            my_flight.m_p_result = p_result;
+        }
+        catch( ... )
+        {
+            my_flight.m_error = std::current_exception();
+        }
+
+        {
+            // After this no more callers can join
+            std::lock_guard< std::mutex > lock( my_shard.m_mutex );
+            my_shard.m_flights.erase( key );
+            n_joined = my_flight.m_n_joined;
+        }
+
+        if( n_joined == 0 )
+        {
+            // Nobody to tell
+            if( my_flight.m_error )
+                std::rethrow_exception( my_flight.m_error );
+            return my_flight.m_p_result;
+        }
+
+        {
+            std::lock_guard< std::mutex > lock( my_flight.m_mutex );
+            my_flight.m_is_resolved.store( true, std::memory_order_release );
+        }
+        my_flight.m_cv.notify_all();
+
+        if( my_flight.m_error )
+            std::rethrow_exception( my_flight.m_error );
+        return my_flight.m_p_result;
+    }
+
+    corral_single_flight( const corral_single_flight & );   // Disable copying
+    corral_single_flight & operator = ( const corral_single_flight & );
+};
+
+} // namespace crrl
+
+#endif  // CORRAL_SINGLE_FLIGHT_H
@@ -0,0 +1,210 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "corral-slot-map.h"
+
+#include "annotate-lite.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace crrl;
+
+class bad_corral_conn : public bad_corral {};
+
+class conn {};
+
+int n_conns_reset = 0;
+
+namespace crrl {
+template<>
+struct corral_config< conn >
+{
+    typedef int value_t;
+    static bool validator( const value_t & c ) { return c >= 0; }
+    static void on_reset( value_t & c ) { ++n_conns_reset; }
+    typedef bad_corral_conn Texception;
+};
+}   // namespace crrl
+
+typedef corral_slot_map< conn > conn_map_t;
+
+void slot_map_example()
+{
+    n_conns_reset = 0;
+    {
+        conn_map_t conns;
+        corral<conn> c1( 101 ), c2( 102 ), bad( -1 );
+        conn_map_t::id_t id1 = conns.insert( c1 );
+        conn_map_t::id_t id2 = conns.insert( c2 );
+        Verify( ! c1.is_valid() && ! c2.is_valid(), "Did slot_map_example insert() take the corrals?" );
+        Verify( conns.insert( bad ) == conn_map_t::id_t(), "Did slot_map_example reject an invalid corral?" );
+        Verify( conns.size() == 2, "Does slot_map_example hold 2 handles?" );
+        Verify( conns.get( id1 ) == 101 && *conns.find( id2 ) == 102, "Did slot_map_example look up handles?" );
+        Verify( ! conns.contains( conn_map_t::id_t() ), "Does slot_map_example null id refer to nothing?" );
+
+        Verify( conns.erase( id1 ), "Did slot_map_example erase id1?" );
+        Verify( n_conns_reset == 1, "Did slot_map_example erase() call on_reset?" );
+        Verify( ! conns.erase( id1 ), "Did slot_map_example refuse to erase id1 twice?" );
+        Verify( conns.find( id1 ) == 0, "Is slot_map_example id1 stale?" );
+        Verify( conns.get( id2 ) == 102, "Is slot_map_example id2 still current after a move?" );
+
+        corral<conn> c3( 103 );
+        conn_map_t::id_t id3 = conns.insert( c3 );
+        Verify( ( id3 & 0xfffff ) == ( id1 & 0xfffff ), "Did slot_map_example reuse id1's slot?" );
+        Verify( id3 != id1 && ! conns.contains( id1 ), "Did slot_map_example reused slot get a new generation?" );
+
+        try
+        {
+            conns.get( id1 );
+            Bad( "slot_map_example stale get() didn't throw" );
+        }
+        catch( bad_corral_conn & )
+        {
+            Good( "slot_map_example stale get() threw bad_corral_conn" );
+        }
+
+        int sum = 0;
+        size_t n_matched = 0;
+        conns.for_each( [&]( conn_map_t::id_t id, int & c ) {
+                sum += c;
+                if( conns.get( id ) == c )
+                    ++n_matched;
+            } );
+        Verify( sum == 205 && n_matched == 2, "Did slot_map_example for_each() visit live handles with their ids?" );
+
+        corral<conn> out;
+        Verify( conns.extract( id2, out ) && out.get() == 102, "Did slot_map_example extract id2?" );
+        Verify( n_conns_reset == 1, "Did slot_map_example extract() avoid on_reset?" );
+        Verify( ! conns.contains( id2 ) && conns.size() == 1, "Did slot_map_example extract() remove id2?" );
+    }
+    Verify( n_conns_reset == 3, "Did slot_map_example reset remaining handles on destruction?" );
+}
+
+void slot_map_many_example()
+{
+    n_conns_reset = 0;
+    corral_slot_map< conn, uint64_t > conns;
+    std::vector< uint64_t > ids;
+    for( int i = 0; i < 200000; ++i )
+    {
+        corral<conn> c( i );
+        ids.push_back( conns.insert( c ) );
+    }
+    for( int i = 0; i < 200000; i += 2 )
+        conns.erase( ids[i] );
+    bool is_all_ok = conns.size() == 100000;
+    for( int i = 0; i < 200000; ++i )
+    {
+        const int * p_c = conns.find( ids[i] );
+        if( i % 2 == 0 ? p_c != 0 : ( p_c == 0 || *p_c != i ) )
+            is_all_ok = false;
+    }
+    Verify( is_all_ok, "Did slot_map_many_example find exactly the live 64-bit ids?" );
+    conns.clear();
+    Verify( n_conns_reset == 200000 && conns.empty(), "Did slot_map_many_example clear() reset everything?" );
+    Verify( ! conns.contains( ids[1] ), "Are slot_map_many_example ids stale after clear()?" );
+}
+
+void slot_map_generation_wrap_example()
+{
+    conn_map_t conns;
+    corral<conn> c( 1 );
+    conn_map_t::id_t first = conns.insert( c );
+    conn_map_t::id_t id = first;
+    for( int i = 1; i < 4095; ++i )     // 12 bits of generation with 32 bit ids
+    {
+        conns.erase( id );
+        corral<conn> next( 1 );
+        id = conns.insert( next );
+    }
+    Verify( ( id & 0xfffff ) == 0, "Did slot_map_generation_wrap_example reuse slot 0 until its last generation?" );
+    Verify( ( id >> 20 ) == 4095, "Is slot_map_generation_wrap_example at the last generation?" );
+    conns.erase( id );
+    corral<conn> last( 1 );
+    id = conns.insert( last );
+    Verify( id == first, "Did slot_map_generation_wrap_example wrap slot 0 to generation 1?" );
+    Verify( conns.size() == 1, "Did slot_map_generation_wrap_example keep using slot 0?" );
+}
+
+#if defined( CORRAL_SLOT_MAP_HAS_SHARED_LOCK )
+void slot_map_concurrent_readers_example()
+{
+    typedef corral_slot_map< conn, uint32_t, bad_corral_conn, corral_config< conn >, corral_slot_map_shared_lock >
+            shared_conn_map_t;
+    shared_conn_map_t conns;
+    std::vector< uint32_t > ids;
+    for( int i = 0; i < 1000; ++i )
+    {
+        corral<conn> c( i );
+        ids.push_back( conns.insert( c ) );
+    }
+
+    std::atomic< bool > is_wrong( false );
+    std::vector< std::thread > readers;
+    for( int r = 0; r < 4; ++r )
+        readers.push_back( std::thread( [&]{
+                for( int pass = 0; pass < 20; ++pass )
+                    for( int i = 0; i < 1000; ++i )
+                    {
+                        int c;
+                        if( conns.lookup( ids[i], c ) && c != i )
+                            is_wrong = true;
+                    }
+            } ) );
+    for( int i = 0; i < 1000; i += 3 )
+    {
+        conns.erase( ids[i] );
+        corral<conn> c( 5000 + i );
+        conns.insert( c );
+    }
+    for( size_t i = 0; i < readers.size(); ++i )
+        readers[i].join();
+    Verify( ! is_wrong, "Did slot_map_concurrent_readers_example readers only see current handles?" );
+}
+#endif
+
+int main( int argc, char * argv[] )
+{
+    slot_map_example();
+    slot_map_many_example();
+    slot_map_generation_wrap_example();
+#if defined( CORRAL_SLOT_MAP_HAS_SHARED_LOCK )
+    slot_map_concurrent_readers_example();
+#endif
+
+    report();
+
+    return 0;
+}
@@ -0,0 +1,418 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// corral_slot_map - Own many corral-managed handles in contiguous storage
+// and refer to them by generation-checked ids.
+//
+// Handles are moved out of corrals into a dense array.  insert() returns an
+// id made up of a slot index and the slot's generation.  Each time a slot is
+// erased its generation is incremented, so an id kept after its handle has
+// been erased no longer matches and lookups with it fail rather than
+// returning a handle that has been closed (or reused).  Generations wrap
+// from their maximum back to 1 (0 is never used), so slots can be reused
+// for ever.  The cost is that an id kept while its slot is reused a full
+// generation cycle's worth of times would match again.
+//
+// The default-constructed id, Tid(), never refers to a handle.
+//
+// With a Tid of 32 bits, ids have 20 bits of index (about a million
+// handles) and 12 bits of generation, so a stale id can match again after
+// 4095 reuses of its slot.  With 64 bits, they have 32 of each, which makes
+// that practically impossible; use uint64_t ids if handles are erased often
+// and ids may be kept for long.
+//
+// Iteration with for_each() is not stable.  erase() moves the last handle
+// into the erased handle's place, which changes the order.
+//
+// When CORRAL_TRACE is defined, handles in the map are reported by the
+// tracer as handed off rather than released.
+//
+// All the handles share the map's config, which is copied in at
+// construction.  erase() and the destructor reset handles using the
+// config's on_reset().
+//
+// By default there is no locking.  For concurrent readers, use
+// corral_slot_map_shared_lock as Tlock and use lookup() or visit() (not
+// find(), which returns a pointer that a writer could invalidate).
+//
+// Unlike corral.h, this file requires C++11 (C++14 for
+// corral_slot_map_shared_lock).
+
+#ifndef CORRAL_SLOT_MAP_H
+#define CORRAL_SLOT_MAP_H
+
+#include "corral.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+#if __cplusplus >= 201402L || ( defined( _MSVC_LANG ) && _MSVC_LANG >= 201402L )
+#include <shared_mutex>
+#define CORRAL_SLOT_MAP_HAS_SHARED_LOCK 1
+#endif
+
+namespace crrl {
+
+class bad_corral_slot_map : public bad_corral   // The map is full
+{
+    virtual const char * what() const throw()
+    {
+        return "bad_corral_slot_map exception";
+    }
+};
+
+struct corral_slot_map_no_lock
+{
+    void lock() {}
+    void unlock() {}
+    void lock_shared() {}
+    void unlock_shared() {}
+};
+
+#if defined( CORRAL_SLOT_MAP_HAS_SHARED_LOCK )
+class corral_slot_map_shared_lock
+{
+private:
+    std::shared_timed_mutex m_mutex;
+
+public:
+    void lock() { m_mutex.lock(); }
+    void unlock() { m_mutex.unlock(); }
+    void lock_shared() { m_mutex.lock_shared(); }
+    void unlock_shared() { m_mutex.unlock_shared(); }
+};
+#endif
+
+template< typename TvalueId,
+            typename Tid = uint32_t,
+            typename Texception = typename corral_config<TvalueId>::Texception,
+            typename Tconfig = corral_config< TvalueId >,
+            typename Tlock = corral_slot_map_no_lock >
+class corral_slot_map
+{
+public:
+    typedef typename corral_config<TvalueId>::value_t value_t;
+    typedef Tid id_t;
+
+private:
+    static_assert( std::is_unsigned< Tid >::value && sizeof( Tid ) >= 4,
+                    "corral_slot_map ids must be unsigned and at least 32 bits" );
+
+    static const unsigned n_index_bits = sizeof( Tid ) == 4 ? 20 : 32;
+    static const Tid index_mask = ( Tid( 1 ) << n_index_bits ) - 1;
+    static const Tid max_generation = ( ~Tid( 0 ) ) >> n_index_bits;
+
+    struct slot
+    {
+        Tid m_generation;   // Never 0
+        size_t m_dense;     // Index into m_values when in use
+#if defined( CORRAL_TRACE )
+        corral_trace_id m_trace_id;     // See corral-trace.h
+#endif
+    };
+
+    // Handles, densely packed, with the map's config alongside
+    corral_config_store< Tconfig, std::vector< value_t > > m_values;
+    std::vector< Tid > m_dense_to_slot;
+    std::vector< slot > m_slots;
+    std::vector< Tid > m_free_slots;
+    mutable Tlock m_lock;
+
+    class exclusive_guard
+    {
+        Tlock & m_lock;
+    public:
+        explicit exclusive_guard( Tlock & lock ) : m_lock( lock ) { m_lock.lock(); }
+        ~exclusive_guard() { m_lock.unlock(); }
+    };
+
+    class shared_guard
+    {
+        Tlock & m_lock;
+    public:
+        explicit shared_guard( Tlock & lock ) : m_lock( lock ) { m_lock.lock_shared(); }
+        ~shared_guard() { m_lock.unlock_shared(); }
+    };
+
+public:
+    explicit corral_slot_map( const Tconfig & config = Tconfig() ) : m_values( config )
+    {}
+    ~corral_slot_map()
+    {
+        clear();
+    }
+
+    size_t size() const
+    {
+        shared_guard guard( m_lock );
+        return m_values.m_value.size();
+    }
+    bool empty() const { return size() == 0; }
+
+    const Tconfig & config() const { return m_values; }
+
+    // Take ownership of c's handle.  Returns Tid() if c is invalid.  Throws
+    // bad_corral_slot_map (leaving c unchanged) if there are no ids left.
+    template< typename Uexception >
+    Tid insert( corral< TvalueId, Uexception, Tconfig > & c )
+    {
+        if( ! c.is_valid() )
+            return Tid();
+
+        exclusive_guard guard( m_lock );
+        if( m_free_slots.empty() && m_slots.size() > static_cast< size_t >( index_mask ) )
+            throw bad_corral_slot_map();
+        // Make room first so that nothing can throw once c has been released.
+        // m_free_slots always has room for every slot, so that erase() and
+        // clear() can't throw either.
+        make_room_for_one( m_values.m_value );
+        make_room_for_one( m_dense_to_slot );
+        if( m_free_slots.empty() )
+        {
+            make_room_for_one( m_slots );
+            if( m_free_slots.capacity() < m_slots.size() + 1 )
+                m_free_slots.reserve( m_slots.capacity() );
+            slot new_slot = slot();
+            new_slot.m_generation = 1;
+            m_slots.push_back( new_slot );
+            m_free_slots.push_back( static_cast< Tid >( m_slots.size() - 1 ) );
+        }
+
+        Tid index = m_free_slots.back();
+        m_free_slots.pop_back();
+        slot & my_slot = m_slots[index];
+        my_slot.m_dense = m_values.m_value.size();
+#if defined( CORRAL_TRACE )
+        my_slot.m_trace_id = c.trace_id();
+#endif
+        m_values.m_value.push_back( c.release() );
+#if defined( CORRAL_TRACE )
+        corral_tracer::handed_off( my_slot.m_trace_id );
+#endif
+        m_dense_to_slot.push_back( index );
+        return make_id( index, my_slot.m_generation );
+    }
+
+    bool contains( Tid id ) const
+    {
+        shared_guard guard( m_lock );
+        return find_slot( id ) != 0;
+    }
+
+    // Returns 0 if id does not refer to a current handle.  Not for use with
+    // concurrent writers.
+    value_t * find( Tid id )
+    {
+        const slot * p_slot = find_slot( id );
+        return p_slot ? &m_values.m_value[p_slot->m_dense] : 0;
+    }
+    const value_t * find( Tid id ) const
+    {
+        const slot * p_slot = find_slot( id );
+        return p_slot ? &m_values.m_value[p_slot->m_dense] : 0;
+    }
+
+    // Throws Texception if id does not refer to a current handle.  Not for
+    // use with concurrent writers.
+    value_t & get( Tid id )
+    {
+        value_t * p_value = find( id );
+        if( ! p_value )
+            throw Texception();
+        return *p_value;
+    }
+    const value_t & get( Tid id ) const
+    {
+        const value_t * p_value = find( id );
+        if( ! p_value )
+            throw Texception();
+        return *p_value;
+    }
+
+    // Copy the handle for id into value.  Returns false if id is stale.
+    bool lookup( Tid id, value_t & value ) const
+    {
+        shared_guard guard( m_lock );
+        const slot * p_slot = find_slot( id );
+        if( ! p_slot )
+            return false;
+        value = m_values.m_value[p_slot->m_dense];
+        return true;
+    }
+
+    // Call f( const value_t & ) with the handle for id while holding the
+    // read lock.  Returns false if id is stale.
+    template< typename Tfunction >
+    bool visit( Tid id, Tfunction f ) const
+    {
+        shared_guard guard( m_lock );
+        const slot * p_slot = find_slot( id );
+        if( ! p_slot )
+            return false;
+        f( m_values.m_value[p_slot->m_dense] );
+        return true;
+    }
+
+    // Reset the handle for id.  Returns false if id is stale.
+    bool erase( Tid id )
+    {
+        value_t value;
+        {
+            exclusive_guard guard( m_lock );
+            if( ! remove( id, value ) )
+                return false;
+        }
+        m_values.on_reset( value );     // Outside the lock as it may be slow
+        return true;
+    }
+
+    // Move the handle for id back into a corral, without resetting it.
+    // Returns false, leaving 'into' reset, if id is stale or the handle no
+    // longer passes the validator (in which case it is reset).
+    template< typename Uexception >
+    bool extract( Tid id, corral< TvalueId, Uexception, Tconfig > & into )
+    {
+        into.reset();
+        value_t value;
+        {
+            exclusive_guard guard( m_lock );
+            if( ! remove( id, value ) )
+                return false;
+        }
+        corral< TvalueId, Uexception, Tconfig > extracted( value, config() );
+        if( ! extracted.is_valid() )
+        {
+            m_values.on_reset( value );     // Don't leak it
+            return false;
+        }
+        into.take( extracted );
+        return true;
+    }
+
+    // Call f( Tid, value_t & ) for each handle while holding the read lock.
+    // f must not insert or erase.  Entries are visited in insertion order,
+    // except that erase() moves the last entry into the erased entry's place.
+    template< typename Tfunction >
+    void for_each( Tfunction f )
+    {
+        shared_guard guard( m_lock );
+        for( size_t i = 0; i < m_values.m_value.size(); ++i )
+        {
+            Tid index = m_dense_to_slot[i];
+            f( make_id( index, m_slots[index].m_generation ), m_values.m_value[i] );
+        }
+    }
+
+    // Reset all the handles.  Ids issued so far become stale.
+    void clear()
+    {
+        std::vector< value_t > values;
+        {
+            exclusive_guard guard( m_lock );
+            values.swap( m_values.m_value );
+            for( size_t i = 0; i < m_dense_to_slot.size(); ++i )
+                release_slot( m_dense_to_slot[i] );
+            m_dense_to_slot.clear();
+        }
+        for( size_t i = 0; i < values.size(); ++i )
+            m_values.on_reset( values[i] );
+    }
+
+private:
+    template< typename T >
+    static void make_room_for_one( std::vector< T > & v )
+    {
+        if( v.size() == v.capacity() )
+            v.reserve( v.capacity() < 8 ? 8 : v.capacity() * 2 );
+    }
+
+    static Tid make_id( Tid index, Tid generation )
+    {
+        return ( generation << n_index_bits ) | index;
+    }
+
+    const slot * find_slot( Tid id ) const
+    {
+        Tid index = id & index_mask;
+        Tid generation = id >> n_index_bits;
+        if( index >= m_slots.size() || generation == 0 || m_slots[index].m_generation != generation )
+            return 0;
+        return &m_slots[index];
+    }
+
+    bool remove( Tid id, value_t & value )
+    {
+        const slot * p_slot = find_slot( id );
+        if( ! p_slot )
+            return false;
+        size_t dense = p_slot->m_dense;
+        Tid index = id & index_mask;
+
+        value = m_values.m_value[dense];
+        size_t last = m_values.m_value.size() - 1;
+        if( dense != last )
+        {
+            m_values.m_value[dense] = m_values.m_value[last];
+            m_dense_to_slot[dense] = m_dense_to_slot[last];
+            m_slots[m_dense_to_slot[dense]].m_dense = dense;
+        }
+        m_values.m_value.pop_back();
+        m_dense_to_slot.pop_back();
+        release_slot( index );
+        return true;
+    }
+
+    void release_slot( Tid index )
+    {
+        slot & my_slot = m_slots[index];
+#if defined( CORRAL_TRACE )
+        // Closed by the caller, or if extract()ed, traced afresh if sampled
+        corral_tracer::closed( my_slot.m_trace_id );
+        my_slot.m_trace_id = 0;
+#endif
+        if( my_slot.m_generation == max_generation )
+            my_slot.m_generation = 1;   // Wrap, skipping 0
+        else
+            ++my_slot.m_generation;
+        m_free_slots.push_back( index );
+    }
+
+    corral_slot_map( const corral_slot_map & );     // Disable copying
+    corral_slot_map & operator = ( const corral_slot_map & );
+};
+
+} // namespace crrl
+
+#endif  // CORRAL_SLOT_MAP_H
@@ -0,0 +1,214 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "corral-teardown.h"
+
+#include "annotate-lite.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace crrl;
+
+class bad_corral_lockable : public bad_corral {};
+
+class lockable {};
+
+class lockable_close_failed {};
+
+std::mutex close_order_mutex;
+std::vector< int > close_order;
+
+namespace crrl {
+template<>
+struct corral_config< lockable >
+{
+    typedef int value_t;
+    static bool validator( const value_t & h ) { return h >= 0; }
+    static void on_reset( value_t & h )
+    {
+        if( h >= 1000 )     // Simulate a slow close
+            std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+        {
+            std::lock_guard< std::mutex > lock( close_order_mutex );
+            close_order.push_back( h );
+        }
+        if( h >= 500 && h < 1000 )  // Simulate a failing close
+            throw lockable_close_failed();
+    }
+    typedef bad_corral_lockable Texception;
+};
+}   // namespace crrl
+
+size_t close_position( int h )
+{
+    std::lock_guard< std::mutex > lock( close_order_mutex );
+    return std::find( close_order.begin(), close_order.end(), h ) - close_order.begin();
+}
+
+void teardown_order_example()
+{
+    close_order.clear();
+
+    corral_teardown teardown;
+    std::vector< corral_teardown::node_id > dirs;
+    for( int d = 0; d < 10; ++d )
+    {
+        corral<lockable> dir_lock( d );
+        dirs.push_back( teardown.adopt( dir_lock ) );
+        Verify( ! dir_lock.is_valid(), "Did teardown_order_example adopt() take the directory lock?" );
+    }
+    for( int f = 100; f < 500; ++f )
+    {
+        corral<lockable> file( f );
+        teardown.before( teardown.adopt( file ), dirs[f % 10] );
+    }
+    Verify( teardown.size() == 410, "Did teardown_order_example adopt all corrals?" );
+
+    corral_teardown_report report = teardown.run( 4, std::chrono::milliseconds( 10000 ) );
+
+    Verify( report.is_complete(), "Did teardown_order_example complete?" );
+    Verify( report.n_closed == 410, "Did teardown_order_example close all corrals?" );
+    Verify( close_order.size() == 410, "Did teardown_order_example call on_reset for all corrals?" );
+    bool is_ordered = true;
+    for( int f = 100; f < 500; ++f )
+        if( close_position( f ) > close_position( f % 10 ) )
+            is_ordered = false;
+    Verify( is_ordered, "Did teardown_order_example close files before their directory locks?" );
+    Verify( teardown.size() == 0, "Is teardown_order_example teardown empty after run()?" );
+}
+
+void teardown_cycle_example()
+{
+    close_order.clear();
+    try
+    {
+        corral_teardown teardown;
+        corral<lockable> a( 1 ), b( 2 );
+        corral_teardown::node_id a_id = teardown.adopt( a );
+        corral_teardown::node_id b_id = teardown.adopt( b );
+        teardown.before( a_id, b_id );
+        teardown.before( b_id, a_id );
+        teardown.run( 2, std::chrono::milliseconds( 1000 ) );
+        Bad( "teardown_cycle_example didn't throw" );
+    }
+    catch( bad_corral_teardown & )
+    {
+        Good( "teardown_cycle_example threw bad_corral_teardown" );
+    }
+    catch( ... )
+    {
+        Bad( "Unknown teardown_cycle_example exception thrown" );
+    }
+    Verify( close_order.size() == 2, "Did teardown_cycle_example still close its corrals?" );
+}
+
+void teardown_deadline_example()
+{
+    close_order.clear();
+
+    corral_teardown teardown;
+    corral<lockable> slow( 1000 ), waiting( 1 ), unrelated( 2 );
+    corral_teardown::node_id slow_id = teardown.adopt( slow, "slow" );
+    teardown.before( slow_id, teardown.adopt( waiting, "waiting" ) );
+    teardown.adopt( unrelated );
+
+    corral_teardown_report report = teardown.run( 2, std::chrono::milliseconds( 50 ) );
+
+    Verify( ! report.is_complete(), "Did teardown_deadline_example report stragglers?" );
+    Verify( report.n_closed == 1, "Did teardown_deadline_example close the unrelated corral?" );
+    Verify( report.stragglers.size() == 2, "Did teardown_deadline_example report 2 stragglers?" );
+    if( report.stragglers.size() == 2 )
+    {
+        Verify( report.stragglers[0].name == "slow" && report.stragglers[0].was_started,
+                "Is teardown_deadline_example 'slow' reported as started?" );
+        Verify( report.stragglers[1].name == "waiting" && ! report.stragglers[1].was_started,
+                "Is teardown_deadline_example 'waiting' reported as not started?" );
+    }
+
+    Verify( ! report.wait_for_stragglers( std::chrono::milliseconds( 0 ) ),
+            "Is teardown_deadline_example 'slow' still closing?" );
+    Verify( report.wait_for_stragglers( std::chrono::milliseconds( 5000 ) ),
+            "Did teardown_deadline_example wait for 'slow'?" );
+    Verify( close_position( 1000 ) < close_order.size(), "Did teardown_deadline_example 'slow' finish closing?" );
+    Verify( close_position( 1 ) == close_order.size(), "Was teardown_deadline_example 'waiting' abandoned?" );
+}
+
+void teardown_failure_example()
+{
+    close_order.clear();
+    {
+        corral_teardown teardown;
+        corral<lockable> failing( 500 ), fine( 1 );
+        teardown.before( teardown.adopt( failing, "failing" ), teardown.adopt( fine ) );
+
+        corral_teardown_report report = teardown.run( 2, std::chrono::milliseconds( 1000 ) );
+
+        Verify( report.is_complete(), "Did teardown_failure_example complete?" );
+        Verify( report.n_closed == 1, "Did teardown_failure_example close 1 corral?" );
+        Verify( report.failures.size() == 1 && report.failures[0] == "failing",
+                "Did teardown_failure_example report the failed on_reset?" );
+    }
+    Verify( close_order.size() == 2, "Did teardown_failure_example call on_reset only once per corral?" );
+}
+
+void teardown_not_run_example()
+{
+    close_order.clear();
+    {
+        corral_teardown teardown;
+        corral<lockable> file( 100 ), dir_lock( 1 ), other( 2 );
+        corral_teardown::node_id file_id = teardown.adopt( file );
+        teardown.adopt( other );
+        teardown.before( file_id, teardown.adopt( dir_lock ) );
+    }
+    Verify( close_order.size() == 3, "Did teardown_not_run_example close all corrals?" );
+    Verify( close_position( 100 ) < close_position( 1 ),
+            "Did teardown_not_run_example close the file before its directory lock?" );
+}
+
+int main( int argc, char * argv[] )
+{
+    teardown_order_example();
+    teardown_cycle_example();
+    teardown_deadline_example();
+    teardown_failure_example();
+    teardown_not_run_example();
+
+    report();
+
+    return 0;
+}
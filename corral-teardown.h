@@ -0,0 +1,471 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// corral_teardown - Close large numbers of corrals in parallel at shutdown.
+//
+// Corrals are adopted into a corral_teardown object, which then owns them.
+// Ordering constraints such as "close this file before its directory lock"
+// are registered with before().  run() then resets the adopted corrals on
+// a pool of threads, never starting a corral's on_reset() until everything
+// that must be closed before it has been closed.
+//
+// If run() reaches its deadline, corrals that have not been started are
+// released (i.e. abandoned to the operating system) and those that are
+// still closing are left to finish in the background.  Both are listed in
+// the returned report as stragglers.  The background threads keep running
+// after run() returns, so call the report's wait_for_stragglers() before
+// returning from main(); otherwise they may still be running on_reset()
+// functions while static objects are being destructed.
+//
+// If fewer threads can be started than were asked for, run() carries on
+// with those that did start, and if none did, it resets the corrals on the
+// calling thread without a deadline.
+//
+// If an on_reset() throws, the corral's resource is released so that it is
+// not reset a second time, and the failure is listed in the report.
+//
+// Corrals that are never run() are reset, one at a time and still following
+// the before() constraints, when the corral_teardown object is destructed.
+//
+// Unlike corral.h, this file requires C++11.
+
+#ifndef CORRAL_TEARDOWN_H
+#define CORRAL_TEARDOWN_H
+
+#include "corral.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace crrl {
+
+class bad_corral_teardown : public bad_corral
+{
+    virtual const char * what() const throw()
+    {
+        return "bad_corral_teardown exception";
+    }
+};
+
+struct corral_teardown_straggler
+{
+    size_t id;
+    std::string name;
+    bool was_started;   // true if on_reset() was still running at the deadline
+};
+
+namespace teardown_detail {
+
+// The part of a run() that can outlive it
+struct background
+{
+    virtual ~background() {}
+    virtual bool /* is_finished */ wait_until( std::chrono::steady_clock::time_point until ) = 0;
+};
+
+}   // namespace teardown_detail
+
+class corral_teardown;
+
+struct corral_teardown_report
+{
+    corral_teardown_report() : n_closed( 0 ) {}
+
+    size_t n_closed;
+    std::vector< std::string > failures;    // Corrals whose on_reset() threw
+    std::vector< corral_teardown_straggler > stragglers;
+
+    bool is_complete() const { return stragglers.empty(); }
+
+    // Wait at most 'timeout' for the threads still closing stragglers to
+    // finish.  Returns true once they have, after which nothing from the
+    // run() is still running.  If the report is destructed first, the last
+    // of those threads frees the run()'s remaining state when it finishes.
+    bool wait_for_stragglers( std::chrono::milliseconds timeout ) const
+    {
+        return ! m_p_background
+                || m_p_background->wait_until( std::chrono::steady_clock::now() + timeout );
+    }
+
+private:
+    friend class corral_teardown;
+    std::shared_ptr< teardown_detail::background > m_p_background;
+};
+
+class corral_teardown
+{
+public:
+    typedef size_t node_id;
+
+private:
+    enum node_status { pending, running, closed, abandoned };
+
+    struct node
+    {
+        explicit node( const std::string & name )
+            : m_name( name ), m_n_predecessors_open( 0 ), m_status( pending )
+        {}
+        virtual ~node() {}
+        virtual void reset() = 0;
+        virtual void abandon() = 0;
+
+        std::string m_name;
+        std::vector< node_id > m_successors;
+        size_t m_n_predecessors_open;   // Guarded by state::m_mutex while running
+        node_status m_status;           // Guarded by state::m_mutex
+    };
+
+    template< typename Tcorral >
+    struct corral_node : public node
+    {
+        explicit corral_node( const std::string & name ) : node( name ) {}
+        virtual void reset()
+        {
+            try
+            {
+                m_corral.reset();
+            }
+            catch( ... )
+            {
+                // on_reset() threw, leaving the corral valid.  Give up on the
+                // resource rather than have ~corral() call on_reset() again.
+                abandon();
+                throw;
+            }
+        }
+        virtual void abandon()
+        {
+            if( m_corral.is_valid() )
+                m_corral.release();
+        }
+
+        Tcorral m_corral;
+    };
+
+    // Shared with the worker threads so that, if the deadline passes, any
+    // worker still inside an on_reset() can finish after run() has returned.
+    struct state : public teardown_detail::background
+    {
+        state() : m_n_finished( 0 ), m_is_stopping( false ), m_n_workers( 0 ) {}
+        ~state()
+        {
+            // Corrals that weren't run() (e.g. because run() threw) are still
+            // valid.  Close them in an order that respects before(), and
+            // any left over because of a cycle in reverse order of adoption.
+            std::vector< node_id > order;
+            try
+            {
+                topological_order( m_nodes, order );
+            }
+            catch( ... )
+            {
+                order.clear();
+            }
+            for( size_t i = 0; i < order.size(); ++i )
+                reset_quietly( m_nodes[order[i]] );
+            for( size_t i = m_nodes.size(); i > 0; --i )
+            {
+                reset_quietly( m_nodes[i-1] );
+                delete m_nodes[i-1];
+            }
+        }
+
+        virtual bool wait_until( std::chrono::steady_clock::time_point until )
+        {
+            std::unique_lock< std::mutex > lock( m_mutex );
+            return m_exit_cv.wait_until( lock, until, [&]{ return m_n_workers == 0; } );
+        }
+
+        static void reset_quietly( node * p_node )
+        {
+            try
+            {
+                p_node->reset();
+            }
+            catch( ... )
+            {}
+        }
+
+        std::vector< node * > m_nodes;
+        std::vector< node_id > m_ready;
+        size_t m_n_finished;
+        bool m_is_stopping;
+        size_t m_n_workers;             // Threads that haven't yet left worker()
+        corral_teardown_report m_report;
+        std::mutex m_mutex;
+        std::condition_variable m_work_cv;
+        std::condition_variable m_done_cv;
+        std::condition_variable m_exit_cv;
+    };
+
+    std::shared_ptr< state > m_state;
+
+public:
+    corral_teardown() : m_state( std::make_shared< state >() )
+    {}
+
+    size_t size() const { return m_state->m_nodes.size(); }
+
+    // Take ownership of c's resource.  Returns an id for use with before().
+    template< typename TvalueId, typename Texception, typename Tconfig >
+    node_id adopt( corral< TvalueId, Texception, Tconfig > & c, const std::string & name = std::string() )
+    {
+        std::unique_ptr< corral_node< corral< TvalueId, Texception, Tconfig > > >
+                p_node( new corral_node< corral< TvalueId, Texception, Tconfig > >( name ) );
+        m_state->m_nodes.push_back( 0 );
+        p_node->m_corral.take( c );
+        m_state->m_nodes.back() = p_node.release();
+        return m_state->m_nodes.size() - 1;
+    }
+
+    // Require that the corral 'first' is closed before 'second' is reset.
+    void before( node_id first, node_id second )
+    {
+        if( first >= size() || second >= size() || first == second )
+            throw bad_corral_teardown();
+        m_state->m_nodes[first]->m_successors.push_back( second );
+    }
+
+    // Reset all the adopted corrals using n_threads threads (0 means one per
+    // core) and wait at most 'deadline' for them to finish.  Throws
+    // bad_corral_teardown, without closing anything, if the before()
+    // constraints contain a cycle.  The corral_teardown object is empty
+    // afterwards and can be reused.
+    corral_teardown_report run( unsigned n_threads, std::chrono::milliseconds deadline )
+    {
+        std::shared_ptr< state > p_state( m_state );
+        std::vector< node * > & nodes = p_state->m_nodes;
+
+        for( size_t i = 0; i < nodes.size(); ++i )
+            nodes[i]->m_n_predecessors_open = 0;
+        for( size_t i = 0; i < nodes.size(); ++i )
+            for( size_t j = 0; j < nodes[i]->m_successors.size(); ++j )
+                ++nodes[nodes[i]->m_successors[j]]->m_n_predecessors_open;
+
+        check_acyclic( nodes );
+
+        if( n_threads == 0 )
+            n_threads = std::thread::hardware_concurrency();
+        if( n_threads == 0 )
+            n_threads = 1;
+        if( n_threads > nodes.size() )
+            n_threads = static_cast< unsigned >( nodes.size() );
+
+        std::vector< std::thread > workers;
+        workers.reserve( n_threads );   // So that adding a started thread can't throw
+
+        m_state = std::make_shared< state >();
+
+        for( size_t i = 0; i < nodes.size(); ++i )
+            if( nodes[i]->m_n_predecessors_open == 0 )
+                p_state->m_ready.push_back( i );
+
+        p_state->m_n_workers = n_threads;     // Before any worker can leave
+        try
+        {
+            for( unsigned i = 0; i < n_threads; ++i )
+                workers.emplace_back( &corral_teardown::worker, p_state );
+        }
+        catch( const std::system_error & )
+        {
+            // Carry on with the threads that started
+            std::lock_guard< std::mutex > lock( p_state->m_mutex );
+            p_state->m_n_workers -= n_threads - workers.size();
+        }
+        if( workers.empty() )
+        {
+            p_state->m_n_workers = 1;
+            worker( p_state );  // Returns when all are closed
+            corral_teardown_report report( p_state->m_report );
+            return report;
+        }
+
+        std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + deadline;
+        std::unique_lock< std::mutex > lock( p_state->m_mutex );
+        bool is_done = p_state->m_done_cv.wait_until( lock, until,
+                [&]{ return p_state->m_n_finished == nodes.size(); } );
+
+        if( is_done )
+        {
+            p_state->m_is_stopping = true;
+            p_state->m_work_cv.notify_all();
+            corral_teardown_report report( p_state->m_report );
+            lock.unlock();
+            for( size_t i = 0; i < workers.size(); ++i )
+                workers[i].join();
+            return report;
+        }
+
+        p_state->m_is_stopping = true;
+        for( size_t i = 0; i < nodes.size(); ++i )
+        {
+            node * p_node = nodes[i];
+            if( p_node->m_status == pending )
+            {
+                p_node->abandon();
+                p_node->m_status = abandoned;
+            }
+            if( p_node->m_status != closed )
+            {
+                corral_teardown_straggler straggler;
+                straggler.id = i;
+                straggler.name = display_name( i, p_node );
+                straggler.was_started = p_node->m_status == running;
+                p_state->m_report.stragglers.push_back( straggler );
+            }
+        }
+        p_state->m_work_cv.notify_all();
+        corral_teardown_report report( p_state->m_report );
+        report.m_p_background = p_state;
+        lock.unlock();
+        for( size_t i = 0; i < workers.size(); ++i )
+            workers[i].detach();    // Each holds p_state until it exits
+        return report;
+    }
+
+private:
+    // Kahn's algorithm.  Nodes that are ready at the same time come out in
+    // reverse order of adoption.  Nodes on (or after) a cycle are left out.
+    static bool /* is_acyclic */ topological_order( const std::vector< node * > & nodes,
+                                                    std::vector< node_id > & order )
+    {
+        std::vector< size_t > n_open( nodes.size() );
+        for( size_t i = 0; i < nodes.size(); ++i )
+            for( size_t j = 0; j < nodes[i]->m_successors.size(); ++j )
+                ++n_open[nodes[i]->m_successors[j]];
+        std::vector< node_id > ready;
+        for( size_t i = 0; i < nodes.size(); ++i )
+            if( n_open[i] == 0 )
+                ready.push_back( i );
+        order.clear();
+        while( ! ready.empty() )
+        {
+            node_id id = ready.back();
+            ready.pop_back();
+            order.push_back( id );
+            const std::vector< node_id > & successors = nodes[id]->m_successors;
+            for( size_t j = 0; j < successors.size(); ++j )
+                if( --n_open[successors[j]] == 0 )
+                    ready.push_back( successors[j] );
+        }
+        return order.size() == nodes.size();
+    }
+
+    static void check_acyclic( const std::vector< node * > & nodes )
+    {
+        std::vector< node_id > order;
+        if( ! topological_order( nodes, order ) )
+            throw bad_corral_teardown();
+    }
+
+    static std::string display_name( node_id id, const node * p_node )
+    {
+        if( ! p_node->m_name.empty() )
+            return p_node->m_name;
+        std::ostringstream name;
+        name << "#" << id;
+        return name.str();
+    }
+
+    static void worker( std::shared_ptr< state > p_state )
+    {
+        std::unique_lock< std::mutex > lock( p_state->m_mutex );
+        for(;;)
+        {
+            p_state->m_work_cv.wait( lock,
+                    [&]{ return p_state->m_is_stopping || ! p_state->m_ready.empty()
+                                || p_state->m_n_finished == p_state->m_nodes.size(); } );
+            if( p_state->m_is_stopping || p_state->m_ready.empty() )
+            {
+                --p_state->m_n_workers;
+                p_state->m_exit_cv.notify_all();
+                return;
+            }
+
+            node_id id = p_state->m_ready.back();
+            p_state->m_ready.pop_back();
+            node * p_node = p_state->m_nodes[id];
+            p_node->m_status = running;
+            lock.unlock();
+
+            bool is_failed = false;
+            try
+            {
+                p_node->reset();
+            }
+            catch( ... )
+            {
+                is_failed = true;
+            }
+
+            size_t n_newly_ready = 0;
+            lock.lock();
+            p_node->m_status = closed;
+            ++p_state->m_n_finished;
+            if( is_failed )
+                p_state->m_report.failures.push_back( display_name( id, p_node ) );
+            else
+                ++p_state->m_report.n_closed;
+            for( size_t j = 0; j < p_node->m_successors.size(); ++j )
+            {
+                node_id successor = p_node->m_successors[j];
+                if( --p_state->m_nodes[successor]->m_n_predecessors_open == 0 )
+                {
+                    p_state->m_ready.push_back( successor );
+                    ++n_newly_ready;
+                }
+            }
+            if( p_state->m_n_finished == p_state->m_nodes.size() )
+            {
+                p_state->m_done_cv.notify_all();
+                p_state->m_work_cv.notify_all();
+            }
+            else if( n_newly_ready > 1 )
+                p_state->m_work_cv.notify_all();
+            else if( n_newly_ready == 1 )
+                p_state->m_work_cv.notify_one();
+        }
+    }
+};
+
+} // namespace crrl
+
+#endif  // CORRAL_TEARDOWN_H
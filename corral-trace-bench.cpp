@@ -0,0 +1,110 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// Measures the cost tracing adds to corrals.  Build it twice and compare:
+//
+//     g++ -std=c++11 -O2 corral-trace-bench.cpp
+//     g++ -std=c++11 -O2 -DCORRAL_TRACE corral-trace-bench.cpp
+//
+// The first gives the cost with tracing compiled out.  The second gives the
+// cost with sampling off, when unsampled corrals pay only a flag test on
+// acquisition, and with 1 in 1024 sampled.
+
+#include "corral.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace crrl;
+
+class bad_corral_bench : public bad_corral {};
+
+class bench_handle {};
+
+// Called through volatile pointers, like a real open() and close() the
+// compiler can't see into them or fold the corrals away
+int open_handle( int i ) { return i; }
+void close_handle( int h ) {}
+int (* volatile p_open_handle)( int ) = open_handle;
+void (* volatile p_close_handle)( int ) = close_handle;
+
+namespace crrl {
+template<>
+struct corral_config< bench_handle >
+{
+    typedef int value_t;
+    static bool validator( const value_t & h ) { return h >= 0; }
+    static void on_reset( value_t & h ) { p_close_handle( h ); }
+    typedef bad_corral_bench Texception;
+};
+}   // namespace crrl
+
+// Acquire, take() into another corral and reset.  Returns the best of
+// several runs, to reduce noise from the rest of the machine.
+double ns_per_corral( int n_corrals )
+{
+    double best = 0;
+    for( int run = 0; run < 5; ++run )
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for( int i = 0; i < n_corrals; ++i )
+        {
+            corral<bench_handle> acquired( p_open_handle( i ) );
+            corral<bench_handle> owner;
+            owner.take( acquired );
+        }
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration< double, std::nano >( elapsed ).count() / n_corrals;
+        if( run == 0 || ns < best )
+            best = ns;
+    }
+    return best;
+}
+
+int main( int argc, char * argv[] )
+{
+    const int n_corrals = 20000000;
+
+    ns_per_corral( n_corrals / 10 );    // Warm up
+
+#if defined( CORRAL_TRACE )
+    corral_tracer::set_sample_interval( 0 );
+    std::cout << "traced, sampling off:  " << ns_per_corral( n_corrals ) << " ns/corral\n";
+    corral_tracer::set_sample_interval( 1024 );
+    std::cout << "traced, 1 in 1024:     " << ns_per_corral( n_corrals ) << " ns/corral\n";
+#else
+    std::cout << "tracing compiled out:  " << ns_per_corral( n_corrals ) << " ns/corral\n";
+#endif
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#if ! defined( CORRAL_TRACE )
+#define CORRAL_TRACE
+#endif
+#include "corral.h"
+
+#include "corral-slot-map.h"
+
+#include "annotate-lite.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace crrl;
+
+class bad_corral_traced : public bad_corral {};
+
+class traced {};
+
+namespace crrl {
+template<>
+struct corral_config< traced >
+{
+    typedef int value_t;
+    static bool validator( const value_t & h ) { return h >= 0; }
+    static void on_reset( value_t & h ) {}
+    typedef bad_corral_traced Texception;
+};
+}   // namespace crrl
+
+size_t n_open( bool is_released )
+{
+    std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::nanoseconds( 0 ) );
+    size_t n = 0;
+    for( size_t i = 0; i < open.size(); ++i )
+        if( open[i].is_released() == is_released )
+            ++n;
+    return n;
+}
+
+corral<traced> open_traced( int h )
+{
+    return corral<traced>( h );
+}
+
+void trace_release_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    size_t n_released_before = n_open( true );
+    {
+        corral<traced> closed( 1 );
+        corral<traced> leaked( 2 );
+        leaked.release();
+        corral<traced> invalid( -1 );
+    }
+    Verify( n_open( true ) == n_released_before + 1, "Did trace_release_example report the released handle?" );
+    Verify( n_open( false ) == 0, "Did trace_release_example report no owned handles?" );
+
+    std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::hours( 1 ) );
+    Verify( open.empty(), "Did trace_release_example threshold hide young handles?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_transfer_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    {
+        corral<traced> returned( open_traced( 3 ) );
+        corral<traced> moved( returned );
+        corral<traced> taker;
+        taker.take( moved );
+
+        std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::nanoseconds( 0 ) );
+        size_t n_owned = 0;
+        for( size_t i = 0; i < open.size(); ++i )
+            if( ! open[i].is_released() )
+            {
+                ++n_owned;
+                Verify( open[i].last_event == corral_trace_take, "Is trace_transfer_example last event take()?" );
+                Verify( open[i].site != 0, "Did trace_transfer_example record the acquisition site?" );
+            }
+        Verify( n_owned == 1, "Did trace_transfer_example follow 1 handle through transfers?" );
+    }
+    Verify( n_open( false ) == 0, "Did trace_transfer_example see the handle reset?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_sampling_example()
+{
+    corral_tracer::set_sample_interval( 4 );
+    size_t n_released_before = n_open( true );
+    std::vector< int > handles;
+    std::thread worker( [&]{
+            for( int i = 0; i < 100; ++i )
+            {
+                corral<traced> h( i );
+                handles.push_back( h.release() );
+            }
+        } );
+    worker.join();
+    Verify( n_open( true ) == n_released_before + 25, "Did trace_sampling_example sample 1 in 4?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_threads_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    corral<traced> acquired;
+    std::thread acquirer( [&]{
+            corral<traced> h( 5 );
+            acquired.take( h );
+        } );
+    acquirer.join();
+    corral<traced> owner;
+    owner.take( acquired );
+
+    std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::nanoseconds( 0 ) );
+    bool is_found = false;
+    for( size_t i = 0; i < open.size(); ++i )
+        if( ! open[i].is_released() )
+        {
+            is_found = true;
+            Verify( open[i].acquiring_thread != open[i].last_thread,
+                    "Did trace_threads_example record the acquiring and taking threads?" );
+        }
+    Verify( is_found, "Did trace_threads_example find the handle?" );
+    owner.reset();
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_ring_wrap_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    size_t n_released_before = n_open( true );
+    std::vector< int > handles;
+    {
+        corral<traced> h( 6 );
+        handles.push_back( h.release() );
+    }
+    for( int i = 0; i < 2100; ++i )     // Each writes 2 events, wrapping the ring
+        corral<traced> h( i );
+    Verify( n_open( true ) == n_released_before + 1, "Did trace_ring_wrap_example still report the leak?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_history_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    corral<traced> acquired( 7 );
+    corral<traced> owner;
+    owner.take( acquired );
+    owner.release();
+
+    std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::nanoseconds( 0 ) );
+    Verify( ! open.empty(), "Did trace_history_example find the handle?" );
+    if( ! open.empty() )
+    {
+        std::vector< corral_trace_event > events = corral_tracer::history( open.back().id );
+        Verify( events.size() == 3, "Did trace_history_example find 3 events?" );
+        if( events.size() == 3 )
+        {
+            Verify( events[0].kind == corral_trace_acquire && events[0].site != 0,
+                    "Did trace_history_example record the acquisition first?" );
+            Verify( events[1].kind == corral_trace_take, "Did trace_history_example record the take()?" );
+            Verify( events[2].kind == corral_trace_release, "Did trace_history_example record the release()?" );
+            Verify( events[0].ago >= events[2].ago, "Did trace_history_example order the events?" );
+        }
+    }
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_thread_exit_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    size_t n_released_before = n_open( true );
+    std::vector< int > handles;
+    for( int i = 0; i < 50; ++i )   // Each thread's ring is freed when it exits
+    {
+        std::thread worker( [&]{
+                corral<traced> h( i );
+                handles.push_back( h.release() );
+                corral<traced> closed( i );
+            } );
+        worker.join();
+    }
+    Verify( n_open( true ) == n_released_before + 50, "Did trace_thread_exit_example keep handles of exited threads?" );
+
+    std::vector< corral_trace_record > open = corral_tracer::open_handles( std::chrono::nanoseconds( 0 ) );
+    Verify( ! open.empty() && corral_tracer::history( open.back().id ).empty(),
+            "Did trace_thread_exit_example free the exited thread's ring?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_slot_map_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    size_t n_released_before = n_open( true );
+    size_t n_owned_before = n_open( false );
+    {
+        corral_slot_map< traced > handles;
+        corral<traced> h( 8 ), erased( 9 );
+        handles.insert( h );
+        corral_slot_map< traced >::id_t erased_id = handles.insert( erased );
+        Verify( n_open( true ) == n_released_before, "Are trace_slot_map_example handles not reported as released?" );
+        Verify( n_open( false ) == n_owned_before + 2, "Are trace_slot_map_example handles reported as owned?" );
+
+        handles.erase( erased_id );
+        Verify( n_open( false ) == n_owned_before + 1, "Did trace_slot_map_example erase() end the trace?" );
+    }
+    Verify( n_open( false ) == n_owned_before, "Did trace_slot_map_example destructor end the traces?" );
+    Verify( n_open( true ) == n_released_before, "Did trace_slot_map_example report no leaks?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_closed_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    size_t n_released_before = n_open( true );
+    corral<traced> h( 10 );
+    corral_trace_id id = h.trace_id();
+    Verify( id != 0, "Does trace_closed_example corral have a trace id?" );
+    int handle = h.release();
+    Verify( n_open( true ) == n_released_before + 1, "Is trace_closed_example handle released?" );
+    corral_tracer::closed( id );    // i.e. after closing 'handle' some other way
+    Verify( n_open( true ) == n_released_before, "Did trace_closed_example closed() end the trace?" );
+    Verify( handle == 10, "Did trace_closed_example release the handle?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+void trace_table_full_example()
+{
+    corral_tracer::set_sample_interval( 1 );
+    unsigned long n_dropped_before = corral_tracer::n_dropped();
+    std::vector< int > handles;
+    for( int i = 0; i < 70000; ++i )    // More than the table holds
+    {
+        corral<traced> h( i );
+        handles.push_back( h.release() );
+    }
+    Verify( n_open( true ) <= 16 * 4096, "Did trace_table_full_example cap the released handles?" );
+    Verify( corral_tracer::n_dropped() > n_dropped_before, "Did trace_table_full_example count dropped handles?" );
+
+    corral<traced> newest( 11 );
+    Verify( newest.trace_id() != 0, "Was trace_table_full_example newest corral still sampled?" );
+    corral_tracer::set_sample_interval( 0 );
+}
+
+int main( int argc, char * argv[] )
+{
+    trace_release_example();
+    trace_transfer_example();
+    trace_sampling_example();
+    trace_threads_example();
+    trace_ring_wrap_example();
+    trace_history_example();
+    trace_thread_exit_example();
+    trace_slot_map_example();
+    trace_closed_example();
+    trace_table_full_example();     // Leaves the table full
+
+    report();
+
+    return 0;
+}
@@ -0,0 +1,597 @@
+//----------------------------------------------------------------------------
+// Copyright (c) 2014, Codalogic Ltd (http://www.codalogic.com)
+// All rights reserved.
+//
+// The license for this file is based on the BSD-3-Clause license
+// (http://www.opensource.org/licenses/BSD-3-Clause).
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// - Neither the name Codalogic Ltd nor the names of its contributors may be
+//   used to endorse or promote products derived from this software without
+//   specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+// corral_tracer - Sampled tracing of corral ownership, for finding handles
+// that are release()d from a corral and never closed.
+//
+// Tracing is compiled in by defining CORRAL_TRACE before including corral.h
+// (which then includes this file).  When it is compiled in, one in every N
+// corrals that acquire a valid handle is sampled, where N is set with
+// corral_tracer::set_sample_interval() (0, the default, samples nothing).
+// For sampled corrals the acquisition site, thread and time are recorded,
+// followed by each move, bridge, take(), release() and reset().
+//
+// While sampling is off, unsampled corrals pay a single test of a global
+// flag on acquisition and a single test of their trace id in each of the
+// other operations.  While sampling is on, acquisition also decrements a
+// per-thread countdown, which is a load and store of a thread-local.  The
+// recording functions are cold and out of line, and take the trace id by
+// value, so that they don't stop the compiler keeping corrals in registers.
+// corral-trace-bench.cpp measures the result.
+//
+// Each sampled handle that has not yet been reset has an entry in a table
+// kept by the tracer, which corral_tracer::open_handles() reports from.  The
+// table is split into separately locked shards, and only sampled corrals
+// touch it.  Its size is capped.  When a shard is full, the entry for the
+// handle that was released longest ago is dropped to make room, and if
+// there is none, the new corral is not sampled.
+//
+// Events are also written to a fixed size, lock-free ring buffer belonging
+// to the thread that caused them, which corral_tracer::history() reads.
+// Rings keep only recent events, and a thread's ring is freed when the
+// thread exits.
+//
+// The acquisition site is the return address of the function that
+// constructed the corral, which can be turned into a source location with
+// tools such as addr2line.
+//
+// Code that release()s a handle from a corral and then owns it itself
+// should tell the tracer, using the corral's trace_id().  It should call
+// corral_tracer::handed_off() when it takes the handle, so the handle isn't
+// reported as released, and corral_tracer::closed() when it closes the
+// handle or gives it up.  corral_slot_map and corral_handoff_sender do this.
+//
+// Unlike corral.h, this file requires C++11.
+
+#ifndef CORRAL_TRACE_H
+#define CORRAL_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Keep the unsampled path small and the recording out of line
+#if defined( _MSC_VER )
+#include <intrin.h>
+#define CORRAL_TRACE_SITE _ReturnAddress()
+#define CORRAL_TRACE_INLINE __forceinline
+#define CORRAL_TRACE_NOINLINE __declspec( noinline ) inline
+#define CORRAL_TRACE_UNLIKELY( x ) ( x )
+#elif defined( __GNUC__ )
+#define CORRAL_TRACE_SITE __builtin_return_address( 0 )
+#define CORRAL_TRACE_INLINE inline __attribute__(( always_inline ))
+#define CORRAL_TRACE_NOINLINE inline __attribute__(( noinline, cold ))
+#define CORRAL_TRACE_UNLIKELY( x ) __builtin_expect( !! ( x ), 0 )
+#else
+#define CORRAL_TRACE_SITE 0
+#define CORRAL_TRACE_INLINE inline
+#define CORRAL_TRACE_NOINLINE inline
+#define CORRAL_TRACE_UNLIKELY( x ) ( x )
+#endif
+
+namespace crrl {
+
+typedef uint32_t corral_trace_id;   // 0 means not sampled
+
+enum corral_trace_event_kind
+{
+    corral_trace_acquire,
+    corral_trace_move,      // Move constructor
+    corral_trace_bridge,    // Returned from a function, see return_from_function
+    corral_trace_take,
+    corral_trace_release,
+    corral_trace_reset,
+    corral_trace_handoff,   // See corral_tracer::handed_off()
+    corral_trace_close      // See corral_tracer::closed()
+};
+
+struct corral_trace_record
+{
+    corral_trace_id id;
+    const void * site;              // Where the corral was constructed
+    unsigned acquiring_thread;      // Thread numbers are assigned by the tracer
+    unsigned last_thread;
+    corral_trace_event_kind last_event;
+    std::chrono::nanoseconds age;   // Since acquisition
+    std::chrono::nanoseconds idle;  // Since the last event
+
+    bool is_released() const { return last_event == corral_trace_release; }
+};
+
+struct corral_trace_event
+{
+    corral_trace_event_kind kind;
+    unsigned thread;
+    std::chrono::nanoseconds ago;
+    const void * site;              // Only set for corral_trace_acquire
+};
+
+namespace trace_detail {
+
+static const size_t ring_size = 4096;   // Events per thread
+static const size_t n_open_shards = 16;
+static const size_t max_open_per_shard = 4096;
+
+inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Fields are atomics so that readers racing with the owning thread are not
+// undefined behaviour.  m_sequence is odd while the slot is being written.
+struct event_slot
+{
+    event_slot() : m_sequence( 0 ), m_id( 0 ), m_kind( 0 ), m_time_ns( 0 ), m_site( 0 ) {}
+
+    std::atomic< uint64_t > m_sequence;
+    std::atomic< corral_trace_id > m_id;
+    std::atomic< int > m_kind;
+    std::atomic< uint64_t > m_time_ns;
+    std::atomic< const void * > m_site;
+};
+
+// Single writer (the owning thread), any number of readers, using a
+// seqlock on each slot
+struct ring
+{
+    explicit ring( unsigned thread ) : m_thread( thread ), m_next( 0 ) {}
+
+    void push( corral_trace_id id, corral_trace_event_kind kind, uint64_t time_ns, const void * site )
+    {
+        event_slot & slot = m_slots[m_next++ % ring_size];
+        uint64_t sequence = slot.m_sequence.load( std::memory_order_relaxed );
+        slot.m_sequence.store( sequence + 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        slot.m_id.store( id, std::memory_order_relaxed );
+        slot.m_kind.store( kind, std::memory_order_relaxed );
+        slot.m_time_ns.store( time_ns, std::memory_order_relaxed );
+        slot.m_site.store( site, std::memory_order_relaxed );
+        slot.m_sequence.store( sequence + 2, std::memory_order_release );
+    }
+
+    // Returns false if the slot is empty or was being written
+    bool read( size_t i, corral_trace_id & id, corral_trace_event & e ) const
+    {
+        const event_slot & slot = m_slots[i];
+        uint64_t sequence = slot.m_sequence.load( std::memory_order_acquire );
+        if( sequence == 0 || sequence % 2 != 0 )
+            return false;
+        id = slot.m_id.load( std::memory_order_relaxed );
+        e.kind = static_cast< corral_trace_event_kind >( slot.m_kind.load( std::memory_order_relaxed ) );
+        e.ago = std::chrono::nanoseconds( slot.m_time_ns.load( std::memory_order_relaxed ) );
+        e.site = slot.m_site.load( std::memory_order_relaxed );
+        e.thread = m_thread;
+        std::atomic_thread_fence( std::memory_order_acquire );
+        return slot.m_sequence.load( std::memory_order_relaxed ) == sequence;
+    }
+
+    const unsigned m_thread;
+    uint64_t m_next;    // Only used by the owning thread
+    event_slot m_slots[ring_size];
+};
+
+// A sampled handle that has not been reset
+struct open_handle
+{
+    const void * site;
+    unsigned acquiring_thread;
+    unsigned last_thread;
+    corral_trace_event_kind last_event;
+    uint64_t acquired_ns;
+    uint64_t last_ns;
+};
+
+struct alignas( 64 ) open_shard    // Keep each shard's lock on its own cache line
+{
+    std::mutex m_mutex;
+    std::unordered_map< corral_trace_id, open_handle > m_handles;
+    std::deque< corral_trace_id > m_released;   // Oldest first.  Some may since have been reset.
+};
+
+struct registry
+{
+    registry() : m_sample_interval( 0 ), m_next_id( 1 ), m_next_thread( 0 ), m_n_dropped( 0 ) {}
+
+    std::atomic< uint32_t > m_sample_interval;
+    std::atomic< corral_trace_id > m_next_id;
+    std::atomic< unsigned > m_next_thread;
+    std::atomic< unsigned long > m_n_dropped;
+    open_shard m_open[n_open_shards];
+    std::mutex m_rings_mutex;
+    std::vector< std::weak_ptr< ring > > m_rings;   // Freed when their threads exit
+};
+
+inline registry & the_registry()
+{
+    static registry r;
+    return r;
+}
+
+// Constant initialised, so testing it needs no guard
+inline std::atomic< bool > & is_sampling()
+{
+    static std::atomic< bool > is_on( false );
+    return is_on;
+}
+
+inline unsigned this_thread_number()
+{
+    static thread_local unsigned number = 0;    // 0 until assigned
+    if( number == 0 )
+        number = the_registry().m_next_thread.fetch_add( 1, std::memory_order_relaxed ) + 1;
+    return number - 1;
+}
+
+// Set while the thread's thread_local objects are being destroyed, after
+// which events from that thread are no longer written to a ring
+inline bool & is_thread_exiting()
+{
+    static thread_local bool is_exiting = false;
+    return is_exiting;
+}
+
+struct ring_owner
+{
+    ~ring_owner() { is_thread_exiting() = true; }
+    std::shared_ptr< ring > m_p_ring;
+};
+
+// Returns 0 if the thread has no ring and one can't be created
+inline ring * this_thread_ring() noexcept
+{
+    static thread_local ring * p_ring = 0;
+    if( is_thread_exiting() )
+        return 0;
+    if( p_ring )
+        return p_ring;
+    try
+    {
+        static thread_local ring_owner owner;
+        std::shared_ptr< ring > p_new_ring = std::make_shared< ring >( this_thread_number() );
+        registry & r = the_registry();
+        std::lock_guard< std::mutex > lock( r.m_rings_mutex );
+        // Forget rings of threads that have exited
+        r.m_rings.erase( std::remove_if( r.m_rings.begin(), r.m_rings.end(),
+                                            []( const std::weak_ptr< ring > & p ) { return p.expired(); } ),
+                            r.m_rings.end() );
+        r.m_rings.push_back( p_new_ring );
+        owner.m_p_ring = p_new_ring;
+        p_ring = p_new_ring.get();
+    }
+    catch( ... )
+    {
+        return 0;
+    }
+    return p_ring;
+}
+
+inline open_shard & shard_for( corral_trace_id id )
+{
+    return the_registry().m_open[id % n_open_shards];
+}
+
+// Make room in a full shard by forgetting the handle released longest ago
+inline bool /* is_room_made */ drop_oldest_released( open_shard & shard )
+{
+    while( ! shard.m_released.empty() )
+    {
+        corral_trace_id id = shard.m_released.front();
+        shard.m_released.pop_front();
+        std::unordered_map< corral_trace_id, open_handle >::iterator i = shard.m_handles.find( id );
+        if( i != shard.m_handles.end() && i->second.last_event == corral_trace_release )
+        {
+            shard.m_handles.erase( i );
+            the_registry().m_n_dropped.fetch_add( 1, std::memory_order_relaxed );
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remember a release for drop_oldest_released().  Ids that are no longer
+// released are removed once they outnumber the table.
+inline void note_released( open_shard & shard, corral_trace_id id )
+{
+    if( shard.m_released.size() >= 2 * max_open_per_shard )
+    {
+        std::deque< corral_trace_id >::iterator end = std::remove_if(
+                shard.m_released.begin(), shard.m_released.end(),
+                [&]( corral_trace_id released ) {
+                    std::unordered_map< corral_trace_id, open_handle >::const_iterator i =
+                            shard.m_handles.find( released );
+                    return i == shard.m_handles.end() || i->second.last_event != corral_trace_release;
+                } );
+        shard.m_released.erase( end, shard.m_released.end() );
+    }
+    shard.m_released.push_back( id );
+}
+
+inline uint32_t & countdown()
+{
+    static thread_local uint32_t countdown = 1;
+    return countdown;
+}
+
+// noexcept, like record(), so that corrals don't need extra unwinding paths
+CORRAL_TRACE_NOINLINE corral_trace_id sample( const void * site ) noexcept
+{
+    registry & r = the_registry();
+    uint32_t interval = r.m_sample_interval.load( std::memory_order_relaxed );
+    if( interval == 0 )     // Turned off since is_sampling() was tested
+    {
+        countdown() = 1;
+        return 0;
+    }
+    countdown() = interval;
+
+    corral_trace_id id = r.m_next_id.fetch_add( 1, std::memory_order_relaxed );
+    if( id == 0 )   // Wrapped
+        id = r.m_next_id.fetch_add( 1, std::memory_order_relaxed );
+    uint64_t time_ns = now_ns();
+    open_handle handle = { site, this_thread_number(), this_thread_number(), corral_trace_acquire, time_ns, time_ns };
+    try
+    {
+        open_shard & shard = shard_for( id );
+        std::lock_guard< std::mutex > lock( shard.m_mutex );
+        if( shard.m_handles.size() >= max_open_per_shard && ! drop_oldest_released( shard ) )
+        {
+            r.m_n_dropped.fetch_add( 1, std::memory_order_relaxed );
+            return 0;   // Full of handles that are still owned
+        }
+        shard.m_handles[id] = handle;
+    }
+    catch( ... )
+    {
+        return 0;   // Can't track it, so don't sample it
+    }
+    if( ring * p_ring = this_thread_ring() )
+        p_ring->push( id, corral_trace_acquire, time_ns, site );
+    return id;
+}
+
+// Called when a corral acquires a valid handle.  Returns 0 if not sampled.
+inline corral_trace_id acquire( const void * site )
+{
+    if( ! is_sampling().load( std::memory_order_relaxed ) )
+        return 0;
+    uint32_t & n_to_go = countdown();
+    if( n_to_go > 1 )
+    {
+        --n_to_go;
+        return 0;
+    }
+    return sample( site );
+}
+
+// Called for events after acquisition, only for sampled corrals
+CORRAL_TRACE_NOINLINE void record( corral_trace_id id, corral_trace_event_kind kind ) noexcept
+{
+    uint64_t time_ns = now_ns();
+    {
+        open_shard & shard = shard_for( id );
+        std::lock_guard< std::mutex > lock( shard.m_mutex );
+        std::unordered_map< corral_trace_id, open_handle >::iterator i = shard.m_handles.find( id );
+        if( i != shard.m_handles.end() )
+        {
+            if( kind == corral_trace_reset || kind == corral_trace_close )
+                shard.m_handles.erase( i );
+            else
+            {
+                i->second.last_event = kind;
+                i->second.last_thread = this_thread_number();
+                i->second.last_ns = time_ns;
+                if( kind == corral_trace_release )
+                {
+                    try
+                    {
+                        note_released( shard, id );
+                    }
+                    catch( ... )
+                    {}  // It just won't be dropped when the shard is full
+                }
+            }
+        }
+    }
+    if( ring * p_ring = this_thread_ring() )
+        p_ring->push( id, kind, time_ns, 0 );
+}
+
+}   // namespace trace_detail
+
+// A private base of corral and corral_bridge that holds the trace id
+class corral_trace_handle
+{
+protected:
+    corral_trace_handle() : m_trace_id( 0 ) {}
+
+    corral_trace_id trace_id() const { return m_trace_id; }
+
+    // Forced inline so that CORRAL_TRACE_SITE reports the corral's creator
+    CORRAL_TRACE_INLINE void trace_acquire( bool is_valid )
+    {
+        if( is_valid )
+            m_trace_id = trace_detail::acquire( CORRAL_TRACE_SITE );
+    }
+    void trace_move_from( corral_trace_handle & rhs ) { adopt( rhs, corral_trace_move ); }
+    void trace_bridge_to( corral_trace_handle & bridge ) { bridge.adopt( *this, corral_trace_bridge ); }
+    void trace_bridge_from( corral_trace_handle & bridge )
+    {
+        m_trace_id = bridge.m_trace_id;     // Already recorded by trace_bridge_to()
+        bridge.m_trace_id = 0;
+    }
+    void trace_take_from( corral_trace_handle & rhs ) { adopt( rhs, corral_trace_take ); }
+    void trace_release() { end( corral_trace_release ); }
+    void trace_reset() { end( corral_trace_reset ); }
+
+private:
+    // The id is passed by value so that the corral doesn't escape into the call
+    void adopt( corral_trace_handle & rhs, corral_trace_event_kind kind )
+    {
+        corral_trace_id id = rhs.m_trace_id;
+        rhs.m_trace_id = 0;
+        m_trace_id = id;
+        if( CORRAL_TRACE_UNLIKELY( id != 0 ) )
+            trace_detail::record( id, kind );
+    }
+    void end( corral_trace_event_kind kind )
+    {
+        corral_trace_id id = m_trace_id;
+        m_trace_id = 0;
+        if( CORRAL_TRACE_UNLIKELY( id != 0 ) )
+            trace_detail::record( id, kind );
+    }
+
+    corral_trace_id m_trace_id;
+};
+
+class corral_tracer
+{
+public:
+    // Sample 1 in every 'interval' corrals.  0 turns sampling off.
+    static void set_sample_interval( uint32_t interval )
+    {
+        trace_detail::the_registry().m_sample_interval.store( interval, std::memory_order_relaxed );
+        trace_detail::is_sampling().store( interval != 0, std::memory_order_relaxed );
+    }
+
+    // For a handle that has been release()d from a corral with the given
+    // trace_id() into an owner that will close it, e.g. a container.  The
+    // handle is no longer reported as released.  Ids of 0 are ignored.
+    static void handed_off( corral_trace_id id )
+    {
+        if( id )
+            trace_detail::record( id, corral_trace_handoff );
+    }
+
+    // For a handle outside a corral that has been closed, or that the tracer
+    // should stop following.  The handle is no longer reported.  Ids of 0 are
+    // ignored.
+    static void closed( corral_trace_id id )
+    {
+        if( id )
+            trace_detail::record( id, corral_trace_close );
+    }
+
+    // The number of sampled handles forgotten because the tracer's table was
+    // full.  Handles released longest ago are forgotten first, and corrals
+    // acquired while the table is full of owned handles are not sampled.
+    static unsigned long n_dropped()
+    {
+        return trace_detail::the_registry().m_n_dropped.load( std::memory_order_relaxed );
+    }
+
+    // Return the sampled handles that have not been reset and were acquired
+    // at least 'threshold' ago, oldest first.  Those that have been
+    // release()d and not handed_off() have is_released() true.
+    static std::vector< corral_trace_record > open_handles( std::chrono::nanoseconds threshold )
+    {
+        std::vector< corral_trace_record > open;
+        for( size_t s = 0; s < trace_detail::n_open_shards; ++s )
+        {
+            trace_detail::open_shard & shard = trace_detail::the_registry().m_open[s];
+            std::lock_guard< std::mutex > lock( shard.m_mutex );
+            uint64_t now = trace_detail::now_ns();
+            for( std::unordered_map< corral_trace_id, trace_detail::open_handle >::const_iterator
+                    i = shard.m_handles.begin(); i != shard.m_handles.end(); ++i )
+            {
+                const trace_detail::open_handle & handle = i->second;
+                corral_trace_record record;
+                record.id = i->first;
+                record.site = handle.site;
+                record.acquiring_thread = handle.acquiring_thread;
+                record.last_thread = handle.last_thread;
+                record.last_event = handle.last_event;
+                record.age = std::chrono::nanoseconds( now - handle.acquired_ns );
+                record.idle = std::chrono::nanoseconds( now - handle.last_ns );
+                if( record.age >= threshold )
+                    open.push_back( record );
+            }
+        }
+        std::sort( open.begin(), open.end(), is_older );
+        return open;
+    }
+
+    // Return the events for a sampled handle that are still in the threads'
+    // ring buffers, oldest first.  Older events, and those recorded by
+    // threads that have since exited, are not available.
+    static std::vector< corral_trace_event > history( corral_trace_id id )
+    {
+        std::vector< std::shared_ptr< trace_detail::ring > > rings;
+        {
+            trace_detail::registry & r = trace_detail::the_registry();
+            std::lock_guard< std::mutex > lock( r.m_rings_mutex );
+            for( size_t i = 0; i < r.m_rings.size(); ++i )
+                if( std::shared_ptr< trace_detail::ring > p_ring = r.m_rings[i].lock() )
+                    rings.push_back( p_ring );
+        }
+
+        std::vector< corral_trace_event > events;
+        for( size_t i = 0; i < rings.size(); ++i )
+            for( size_t j = 0; j < trace_detail::ring_size; ++j )
+            {
+                corral_trace_id event_id;
+                corral_trace_event e;
+                if( rings[i]->read( j, event_id, e ) && event_id == id )
+                    events.push_back( e );
+            }
+
+        // Events hold their time since the clock's epoch until now
+        std::sort( events.begin(), events.end(), is_earlier );
+        std::chrono::nanoseconds now( trace_detail::now_ns() );
+        for( size_t i = 0; i < events.size(); ++i )
+            events[i].ago = now - events[i].ago;
+        return events;
+    }
+
+private:
+    static bool is_older( const corral_trace_record & lhs, const corral_trace_record & rhs )
+    {
+        return lhs.age > rhs.age;
+    }
+    static bool is_earlier( const corral_trace_event & lhs, const corral_trace_event & rhs )
+    {
+        return lhs.ago < rhs.ago;
+    }
+};
+
+} // namespace crrl
+
+#endif  // CORRAL_TRACE_H
@@ -43,6 +43,12 @@
 
 #include <exception>
 
+#if defined( CORRAL_TRACE )
+#include "corral-trace.h"
+#else
+#define CORRAL_TRACE_INLINE inline
+#endif
+
 namespace crrl {    // 'corral' without the vowels!
 
 class bad_corral : public std::exception
@@ -87,26 +93,62 @@ struct corral_config_simple
     typedef bad_corral Texception;
 };
 
+// Holds a corral's value along with its copy of the config.  validator()
+// and on_reset() are called through this object so they can be static
+// or non-static members of the config.  Deriving from Tconfig (the empty
+// base optimisation) means a config without data members, such as one
+// with only static functions, adds nothing to the size of a corral.
+template< typename Tconfig, typename Tvalue >
+struct corral_config_store : public Tconfig
+{
+    corral_config_store() : m_value() {}
+    explicit corral_config_store( const Tconfig & config ) : Tconfig( config ), m_value() {}
+    corral_config_store( const Tconfig & config, const Tvalue & value )
+        : Tconfig( config ), m_value( value )
+    {}
+
+    Tvalue m_value;
+};
+
+#if ! defined( CORRAL_TRACE )
+// Ownership tracing hooks.  These do nothing (and, as an empty base, take
+// no space) unless CORRAL_TRACE is defined.  See corral-trace.h.
+typedef unsigned int corral_trace_id;   // Always 0 without CORRAL_TRACE
+
+class corral_trace_handle
+{
+protected:
+    corral_trace_id trace_id() const { return 0; }
+    void trace_acquire( bool is_valid ) {}
+    void trace_move_from( corral_trace_handle & rhs ) {}
+    void trace_bridge_to( corral_trace_handle & bridge ) {}
+    void trace_bridge_from( corral_trace_handle & bridge ) {}
+    void trace_take_from( corral_trace_handle & rhs ) {}
+    void trace_release() {}
+    void trace_reset() {}
+};
+#endif
+
 template< typename TvalueId, typename Tconfig >
-class corral_bridge   // See return_from_function. 1 - define a bridge
+class corral_bridge : private corral_trace_handle  // See return_from_function. 1 - define a bridge
 {
 private:    // corral_bridge is an implementation detail of corral
     template< typename Uvalue, typename Uexception, typename Uconfig > friend class corral;
 
     typedef typename corral_config<TvalueId>::value_t value_t;
 
-    explicit corral_bridge( value_t value, bool is_valid )
-        : m_value( value ), m_is_valid( is_valid )
+    explicit corral_bridge( const corral_config_store< Tconfig, value_t > & store, bool is_valid )
+        : m_is_valid( is_valid ), m_store( store )
     {}
 
     bool m_is_valid;
-    value_t m_value;
+    corral_config_store< Tconfig, value_t > m_store;
 };
 
 template< typename TvalueId,
             typename Texception = typename corral_config<TvalueId>::Texception,
             typename Tconfig = corral_config< TvalueId > >
-class corral
+class corral : private corral_trace_handle
 {
 public:
     typedef typename corral_config<TvalueId>::value_t value_t;
@@ -115,39 +157,51 @@ public:
 private:
     bool m_is_valid;
     bool m_is_owned;
-    value_t m_value;
+    corral_config_store< Tconfig, value_t > m_store;
 
 public:
     corral() : m_is_valid( false ), m_is_owned( false )
     {}
-    corral( value_t value ) : m_value( value )
+    corral( value_t value )
     {
-        m_is_valid = m_is_owned = Tconfig::validator( value );
+        m_store.m_value = value;
+        m_is_valid = m_is_owned = m_store.validator( value );
+        trace_acquire( m_is_valid );
     }
-    corral( value_t value, validator_t validator ) : m_value( value )
+    corral( value_t value, validator_t validator )
     {
+        m_store.m_value = value;
         m_is_valid = m_is_owned = validator( value );
+        trace_acquire( m_is_valid );
+    }
+    corral( value_t value, const Tconfig & config ) : m_store( config, value )
+    {
+        m_is_valid = m_is_owned = m_store.validator( value );
+        trace_acquire( m_is_valid );
     }
     template< typename Uvalue, typename Uexception, typename Uconfig > friend class corral;
-    template< typename Uexception >
-    explicit corral( corral< TvalueId, Uexception, Tconfig > & rhs )
+    corral( corral & rhs ) : m_store( rhs.config() )
     {
         // Really a move()!
-        m_is_valid = m_is_owned = rhs.is_valid();
-        if( m_is_valid )
-            m_value = rhs.m_value;
-        rhs.m_is_valid = rhs.m_is_owned = false;
+        move_from( rhs );
+    }
+    template< typename Uexception >
+    explicit corral( corral< TvalueId, Uexception, Tconfig > & rhs ) : m_store( rhs.config() )
+    {
+        move_from( rhs );
     }
     operator corral_bridge<TvalueId, Tconfig>() // See return_from_function. 2 - Cast to create a bridge
     {
-        corral_bridge<TvalueId, Tconfig> bridge( m_value, m_is_valid );
+        corral_bridge<TvalueId, Tconfig> bridge( m_store, m_is_valid );
+        trace_bridge_to( bridge );
         m_is_valid = m_is_owned = false;
         return bridge;
     }
     corral( corral_bridge<TvalueId, Tconfig> bridge ) // See return_from_function. 3 - Construct from bridge
+        : m_store( bridge.m_store )
     {
-        m_value = bridge.m_value;
         m_is_owned = m_is_valid = bridge.m_is_valid;
+        trace_bridge_from( bridge );
     }
     virtual ~corral()
     {
@@ -163,21 +217,26 @@ public:
     {
         if( ! is_valid() )
             throw Texception();
-        return m_value;
+        return m_store.m_value;
     }
     const value_t & get() const
     {
         if( ! is_valid() )
             throw Texception();
-        return m_value;
+        return m_store.m_value;
     }
+    Tconfig & config() { return m_store; }
+    const Tconfig & config() const { return m_store; }
+    using corral_trace_handle::trace_id;    // For owners of release()d handles, see corral-trace.h
     template< typename Uexception >
     void take( corral< TvalueId, Uexception, Tconfig > & rhs )
     {
         reset();
         if( rhs.is_valid() )
         {
-            m_value = rhs.release();
+            config() = rhs.config();
+            trace_take_from( rhs );     // Before release() so it isn't traced as one
+            m_store.m_value = rhs.release();
             m_is_owned = m_is_valid = true;
         }
     }
@@ -185,18 +244,33 @@ public:
     {
         if( ! is_valid() )
             throw bad_corral_release< Texception >();
+        trace_release();
         m_is_owned = false;
-        return m_value;
+        return m_store.m_value;
     }
-    void reset()
+    // Forced inline when tracing so that the tracing doesn't stop it being
+    // inlined on unwinding paths, which would keep corrals out of registers
+    CORRAL_TRACE_INLINE void reset()
     {
         if( is_valid() )
-            if( ! on_reset( m_value ) )
-                Tconfig::on_reset( m_value );
+        {
+            trace_reset();
+            if( ! on_reset( m_store.m_value ) )
+                m_store.on_reset( m_store.m_value );
+        }
         m_is_valid = m_is_owned = false;
     }
 
 private:
+    template< typename Uexception >
+    void move_from( corral< TvalueId, Uexception, Tconfig > & rhs )
+    {
+        m_is_valid = m_is_owned = rhs.is_valid();
+        if( m_is_valid )
+            m_store.m_value = rhs.m_store.m_value;
+        trace_move_from( rhs );
+        rhs.m_is_valid = rhs.m_is_owned = false;
+    }
     template< typename Uexception > // Disable copy assignment
         corral & operator = ( const corral< TvalueId, Uexception, Tconfig > & rhs );
     virtual bool /* is_resource_released */ on_reset( value_t & value ) { return false; }